@@ -0,0 +1,671 @@
+#include "Benchmarks.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "JobHandle.h"
+#include "JobSystem.h"
+#include "ParallelAlgorithms.h"
+#include "Settings.h"
+#include "Task.h"
+
+#ifdef WAKE_UP_STRESS_TEST
+void RunWakeUpStressTest(int inputThreadCount)
+{
+	//How many jobs each submitted job spawns from inside the worker, so wake ups for local pushes get tested as well.
+	constexpr unsigned int childCount = 3;
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, inputThreadCount);
+	std::atomic<size_t> finishedCycles = 0;
+	std::atomic<bool> finished = false;
+	std::atomic<size_t> executedJobs = 0;
+
+	//The watchdog only looks at the progress, so it can detect a stall even if the waiting thread never wakes up again.
+	std::thread watchdog([&]()
+		{
+			size_t lastFinishedCycles = 0;
+			auto lastProgress = std::chrono::steady_clock::now();
+			while (!finished)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(WAKE_UP_STRESS_DEADLINE_MS / 10 + 1));
+				auto now = std::chrono::steady_clock::now();
+				if (finishedCycles != lastFinishedCycles)
+				{
+					lastFinishedCycles = finishedCycles;
+					lastProgress = now;
+				}
+				else if (now - lastProgress > std::chrono::milliseconds(WAKE_UP_STRESS_DEADLINE_MS))
+				{
+					PRINT_ESSENTIAL(("Wake up stress test stalled in cycle " + std::to_string(lastFinishedCycles) + ", " +
+						std::to_string(executedJobs) + " jobs were executed so far.\n").c_str());
+					exit(1);
+				}
+			}
+		});
+
+	auto startTime = std::chrono::steady_clock::now();
+	long long maxCycleTime = 0;
+	unsigned int random = 2463534242u;
+	for (size_t cycle = 0; cycle < WAKE_UP_STRESS_CYCLES; ++cycle)
+	{
+		auto cycleStart = std::chrono::steady_clock::now();
+		JobCounter counter;
+		Job* job = jobsystem.CreateJob([&jobsystem, &executedJobs, &counter]()
+			{
+				//The children are added to the counter before the parent finishes, so the counter can not reach zero early.
+				for (unsigned int i = 0; i < childCount; ++i)
+				{
+					jobsystem.AddJob(jobsystem.CreateJob([&executedJobs]() { executedJobs++; }), &counter);
+				}
+				executedJobs++;
+			});
+		jobsystem.AddJob(job, &counter);
+		//Helping would run most jobs right here instead of waking the workers up.
+		jobsystem.BlockForCounter(counter);
+		auto cycleEnd = std::chrono::steady_clock::now();
+		maxCycleTime = std::max(maxCycleTime, static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(cycleEnd - cycleStart).count()));
+		finishedCycles++;
+
+		//Every now and then give the workers enough time to park, so the submission has to actually wake them up.
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		if ((random & 31) == 0)
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(random % 500));
+		}
+	}
+	auto endTime = std::chrono::steady_clock::now();
+	finished = true;
+	watchdog.join();
+	jobsystem.JoinJobs();
+
+	size_t expectedJobs = static_cast<size_t>(WAKE_UP_STRESS_CYCLES) * (childCount + 1);
+	if (executedJobs != expectedJobs)
+	{
+		PRINT_ESSENTIAL(("Wake up stress test executed " + std::to_string(executedJobs) + " jobs instead of " + std::to_string(expectedJobs) + ".\n").c_str());
+		exit(1);
+	}
+	long long totalTime = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+	PRINT_ESSENTIAL(("Wake up stress test passed: " + std::to_string(WAKE_UP_STRESS_CYCLES) + " cycles in " + std::to_string(totalTime) +
+		"ms, slowest cycle took " + std::to_string(maxCycleTime) + "us.\n").c_str());
+}
+#endif // WAKE_UP_STRESS_TEST
+
+#ifdef NESTED_WAIT_STRESS_TEST
+static void RunNestedWaitCycles(int workerCount)
+{
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, workerCount);
+	std::atomic<size_t> finishedCycles = 0;
+	std::atomic<bool> finished = false;
+	std::atomic<size_t> executedJobs = 0;
+	std::atomic<size_t> wrongResults = 0;
+	//The system picks the number of workers on its own if none is given.
+	unsigned int actualWorkerCount = jobsystem.GetWorkerCount();
+
+	std::thread watchdog([&]()
+		{
+			size_t lastFinishedCycles = 0;
+			auto lastProgress = std::chrono::steady_clock::now();
+			while (!finished)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(NESTED_WAIT_STRESS_DEADLINE_MS / 10 + 1));
+				auto now = std::chrono::steady_clock::now();
+				if (finishedCycles != lastFinishedCycles)
+				{
+					lastFinishedCycles = finishedCycles;
+					lastProgress = now;
+				}
+				else if (now - lastProgress > std::chrono::milliseconds(NESTED_WAIT_STRESS_DEADLINE_MS))
+				{
+					PRINT_ESSENTIAL(("Nested wait stress test with " + std::to_string(actualWorkerCount) + " workers stalled in cycle " +
+						std::to_string(lastFinishedCycles) + ", " + std::to_string(executedJobs) + " jobs were executed so far.\n").c_str());
+					exit(1);
+				}
+			}
+		});
+
+	auto startTime = std::chrono::steady_clock::now();
+	for (size_t cycle = 0; cycle < NESTED_WAIT_STRESS_CYCLES; ++cycle)
+	{
+		JobCounter counter;
+		//Released by the parent once it is done waiting, so the sibling can not finish before the parent does.
+		JobCounter parentDone;
+		jobsystem.AttachToCounter(parentDone);
+		Job* parent = jobsystem.CreateJob([&jobsystem, &executedJobs, &wrongResults, &counter, &parentDone, cycle]()
+			{
+				jobsystem.AddJob(jobsystem.CreateJob([&jobsystem, &executedJobs, &parentDone]()
+					{
+						jobsystem.WaitForCounter(parentDone);
+						executedJobs++;
+					}), &counter);
+				//Only the dependent is attached to the counter, its dependency has to be worked by the parent as well.
+				JobCounter inner;
+				Job* dependency = jobsystem.CreateJob([&executedJobs]() { executedJobs++; });
+				Job* dependent = jobsystem.CreateJob([&executedJobs]() { executedJobs++; });
+				jobsystem.AddDependency(dependent, dependency);
+				if (cycle % 2 == 0)
+				{
+					jobsystem.AddJob(dependent, &inner);
+					jobsystem.AddJob(dependency);
+				}
+				else
+				{
+					jobsystem.AddJob(dependency);
+					jobsystem.AddJob(dependent, &inner);
+				}
+				jobsystem.WaitForCounter(inner);
+				//Getting a result waits for the job of the handle and the one it depends on, which is only added after.
+				JobHandle<size_t> value = CreateJobWithResult(jobsystem, [cycle]() { return cycle; });
+				Job* valueJob = value.GetJob();
+				JobHandle<size_t> incremented = std::move(value).Then([](size_t& result) { return result + 1; });
+				jobsystem.AddJob(incremented.GetJob());
+				jobsystem.AddJob(valueJob);
+				if (incremented.Get() != cycle + 1)
+				{
+					wrongResults++;
+				}
+				executedJobs++;
+				jobsystem.ReleaseCounter(&parentDone);
+			});
+		jobsystem.AddJob(parent, &counter);
+		//Waiting without helping leaves the parent to the workers, helping may run it on this thread instead.
+		if ((cycle / 2) % 2 == 0)
+		{
+			jobsystem.BlockForCounter(counter);
+		}
+		else
+		{
+			jobsystem.WaitForCounter(counter);
+		}
+		jobsystem.WaitForCounter(parentDone);
+		finishedCycles++;
+	}
+	auto endTime = std::chrono::steady_clock::now();
+	finished = true;
+	watchdog.join();
+	jobsystem.JoinJobs();
+
+	size_t expectedJobs = static_cast<size_t>(NESTED_WAIT_STRESS_CYCLES) * 4;
+	if (executedJobs != expectedJobs)
+	{
+		PRINT_ESSENTIAL(("Nested wait stress test executed " + std::to_string(executedJobs) + " jobs instead of " + std::to_string(expectedJobs) + ".\n").c_str());
+		exit(1);
+	}
+	if (wrongResults != 0)
+	{
+		PRINT_ESSENTIAL(("Nested wait stress test got " + std::to_string(wrongResults) + " wrong results from job handles.\n").c_str());
+		exit(1);
+	}
+	long long totalTime = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+	PRINT_ESSENTIAL(("Nested wait stress test passed with " + std::to_string(actualWorkerCount) + " workers: " + std::to_string(NESTED_WAIT_STRESS_CYCLES) +
+		" cycles in " + std::to_string(totalTime) + "ms.\n").c_str());
+}
+
+void RunNestedWaitStressTest(int inputThreadCount)
+{
+	RunNestedWaitCycles(1);
+	RunNestedWaitCycles(inputThreadCount);
+}
+#endif // NESTED_WAIT_STRESS_TEST
+
+#ifdef STEAL_BENCHMARK
+void RunStealBenchmark(int inputThreadCount)
+{
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, inputThreadCount);
+	std::atomic<size_t> executedJobs = 0;
+
+	auto startTime = std::chrono::steady_clock::now();
+	long long maxFrameTime = 0;
+	for (size_t frame = 0; frame < STEAL_BENCHMARK_FRAME_COUNT; ++frame)
+	{
+		auto frameStart = std::chrono::steady_clock::now();
+		FrameArena* frameArena = jobsystem.BeginFrame();
+		JobCounter counter;
+		//The particle jobs are spawned from inside a job, so they all end up in the queue of the worker running it.
+		Job* job = jobsystem.CreateJob([&jobsystem, &executedJobs, &counter]()
+			{
+				for (unsigned int i = 0; i < STEAL_BENCHMARK_PARTICLE_JOB_COUNT; ++i)
+				{
+					jobsystem.AddJob(jobsystem.CreateJob([&executedJobs]()
+						{
+							auto start = std::chrono::steady_clock::now();
+							while (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() < STEAL_BENCHMARK_JOB_DURATION_US);
+							executedJobs++;
+						}), &counter);
+				}
+			});
+		jobsystem.AddJob(job, &counter);
+		//Helping here could take the parent job, its children would then go to the injection queue instead of a worker.
+		jobsystem.BlockForCounter(counter);
+		jobsystem.EndFrame(frameArena);
+		auto frameEnd = std::chrono::steady_clock::now();
+		maxFrameTime = std::max(maxFrameTime, static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(frameEnd - frameStart).count()));
+	}
+	auto endTime = std::chrono::steady_clock::now();
+
+	long long totalTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
+	PRINT_ESSENTIAL(("Steal benchmark with steal batches of up to " + std::to_string(STEAL_BATCH_SIZE) + " jobs: " +
+		std::to_string(executedJobs) + " particle jobs in " + std::to_string(STEAL_BENCHMARK_FRAME_COUNT) + " frames, average frame time " +
+		std::to_string(totalTime / STEAL_BENCHMARK_FRAME_COUNT) + "us, slowest frame " + std::to_string(maxFrameTime) + "us.\n").c_str());
+	jobsystem.JoinJobs();
+}
+#endif // STEAL_BENCHMARK
+
+#ifdef TOPOLOGY_BENCHMARK
+void RunTopologyBenchmark(int inputThreadCount)
+{
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, inputThreadCount);
+	std::vector<uint64_t> data(TOPOLOGY_BENCHMARK_CHILD_COUNT * TOPOLOGY_BENCHMARK_CHUNK_SIZE / sizeof(uint64_t));
+	std::atomic<long long> stolenCount = 0;
+	std::atomic<long long> stealLatency = 0;
+	std::atomic<long long> readDuration = 0;
+	std::atomic<uint64_t> checksum = 0;
+	//The pages of the buffer stay on the node they were first touched on, which is where the children are sent with
+	//NUMA_AWARE. Hints for other nodes go through the queue of that node's workers.
+	const size_t chunkLength = TOPOLOGY_BENCHMARK_CHUNK_SIZE / sizeof(uint64_t);
+	std::vector<int> chunkNodes;
+	for (unsigned int child = 0; child < TOPOLOGY_BENCHMARK_CHILD_COUNT; ++child)
+	{
+		chunkNodes.push_back(CpuTopology::GetMemoryNode(&data[child * chunkLength]));
+	}
+
+	for (size_t frame = 0; frame < TOPOLOGY_BENCHMARK_FRAME_COUNT; ++frame)
+	{
+		FrameArena* frameArena = jobsystem.BeginFrame();
+		JobCounter counter;
+		Job* job = jobsystem.CreateJob([&, frame]()
+			{
+				//Writing the buffer pulls it into the caches of the parent, the children then read it from wherever they run.
+				for (size_t i = 0; i < data.size(); ++i)
+				{
+					data[i] = i * frame;
+				}
+				int parent = JobSystem::thread_id;
+				for (unsigned int child = 0; child < TOPOLOGY_BENCHMARK_CHILD_COUNT; ++child)
+				{
+					auto addTime = std::chrono::steady_clock::now();
+					Job* childJob = jobsystem.CreateJob([&, child, parent, addTime]()
+						{
+							auto startTime = std::chrono::steady_clock::now();
+							uint64_t sum = 0;
+							for (size_t i = child * chunkLength; i < (child + 1) * chunkLength; ++i)
+							{
+								sum += data[i];
+							}
+							auto endTime = std::chrono::steady_clock::now();
+							checksum += sum;
+							if (JobSystem::thread_id != parent)
+							{
+								stolenCount++;
+								stealLatency += std::chrono::duration_cast<std::chrono::nanoseconds>(startTime - addTime).count();
+								readDuration += std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+							}
+						});
+					jobsystem.SetLocality(childJob, chunkNodes[child]);
+					jobsystem.AddJob(childJob, &counter);
+				}
+			});
+		jobsystem.AddJob(job, &counter);
+		//The parent has to run on a worker, so the children have a queue to be stolen from.
+		jobsystem.BlockForCounter(counter);
+		jobsystem.EndFrame(frameArena);
+	}
+
+	long long stolen = std::max(stolenCount.load(), 1LL);
+#ifdef PIN_WORKERS
+	std::string pinning = "pinned";
+#else
+	std::string pinning = "unpinned";
+#endif
+	PRINT_ESSENTIAL(("Topology benchmark with " + pinning + " workers: " + std::to_string(stolenCount) + " child jobs stolen, average " +
+		std::to_string(stealLatency / stolen) + "ns from adding to starting, average " + std::to_string(readDuration / stolen) +
+		"ns reading " + std::to_string(TOPOLOGY_BENCHMARK_CHUNK_SIZE) + " bytes (checksum " + std::to_string(checksum) + ").\n").c_str());
+	jobsystem.JoinJobs();
+}
+#endif // TOPOLOGY_BENCHMARK
+
+#ifdef PARALLEL_FOR_BENCHMARK
+void RunParallelForBenchmark(int inputThreadCount)
+{
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, inputThreadCount);
+	std::vector<float> positions(PARALLEL_FOR_BENCHMARK_MAX_ITERATIONS, 0.0f);
+	std::vector<float> velocities(PARALLEL_FOR_BENCHMARK_MAX_ITERATIONS, 1.0f);
+	auto integrate = [&positions, &velocities](size_t i)
+		{
+			velocities[i] -= 0.01f * std::sqrt(std::abs(velocities[i]));
+			positions[i] += velocities[i] * 0.016f;
+		};
+
+	//Returns the average time of the given run in microseconds.
+	auto measure = [](auto&& run)
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < PARALLEL_FOR_BENCHMARK_REPETITIONS; ++i)
+			{
+				run();
+			}
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / PARALLEL_FOR_BENCHMARK_REPETITIONS;
+		};
+
+	for (size_t iterations = 1000; iterations <= PARALLEL_FOR_BENCHMARK_MAX_ITERATIONS; iterations *= 10)
+	{
+		long long serialTime = measure([&]()
+			{
+				for (size_t i = 0; i < iterations; ++i)
+				{
+					integrate(i);
+				}
+			});
+		long long fixedGrainTime = measure([&]() { jobsystem.ParallelFor(0, iterations, integrate, PARALLEL_FOR_BENCHMARK_GRAIN_SIZE); });
+		long long autoGrainTime = measure([&]() { jobsystem.ParallelFor(0, iterations, integrate); });
+		PRINT_ESSENTIAL(("ParallelFor benchmark with " + std::to_string(iterations) + " particles: serial " + std::to_string(serialTime) +
+			"us, grain size " + std::to_string(PARALLEL_FOR_BENCHMARK_GRAIN_SIZE) + " " + std::to_string(fixedGrainTime) + "us, automatic grain size " +
+			std::to_string(autoGrainTime) + "us.\n").c_str());
+	}
+	jobsystem.JoinJobs();
+}
+#endif // PARALLEL_FOR_BENCHMARK
+
+#ifdef PARALLEL_ALGORITHMS_BENCHMARK
+//Returns the average time of the given run in microseconds. prepare is run before every repetition without being measured.
+template<typename Prepare, typename Run>
+static long long MeasureAlgorithm(const Prepare& prepare, const Run& run)
+{
+	long long time = 0;
+	for (int i = 0; i < PARALLEL_ALGORITHMS_BENCHMARK_REPETITIONS; ++i)
+	{
+		prepare();
+		auto start = std::chrono::steady_clock::now();
+		run();
+		time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+	return time / PARALLEL_ALGORITHMS_BENCHMARK_REPETITIONS;
+}
+
+static void ReportAlgorithm(const char* name, size_t size, long long serialTime, long long parallelTime, bool isEqual)
+{
+	PRINT_ESSENTIAL(("Parallel algorithms benchmark " + std::string(name) + " of " + std::to_string(size) + " elements: serial " +
+		std::to_string(serialTime) + "us, parallel " + std::to_string(parallelTime) + "us.\n").c_str());
+	if (!isEqual)
+	{
+		PRINT_ESSENTIAL(("Parallel algorithms benchmark " + std::string(name) + " of " + std::to_string(size) + " elements has a wrong result.\n").c_str());
+		exit(1);
+	}
+}
+
+void RunParallelAlgorithmsBenchmark(int inputThreadCount)
+{
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, inputThreadCount);
+	//Random keys like the render keys that get sorted. Reductions and exclusive scans sum them up as 64 bit values.
+	std::vector<uint32_t> input(PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE);
+	unsigned int random = 2463534242u;
+	for (uint32_t& value : input)
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		value = random;
+	}
+	std::vector<uint64_t> serialSums(PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE);
+	std::vector<uint64_t> parallelSums(PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE);
+	std::vector<uint32_t> serialKeys(PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE);
+	std::vector<uint32_t> parallelKeys(PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE);
+	auto nothing = []() {};
+
+	for (size_t size = 1000; size <= PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE; size *= 10)
+	{
+		auto first = input.begin();
+		auto last = input.begin() + size;
+
+		uint64_t serialSum = 0;
+		uint64_t parallelSum = 0;
+		long long serialTime = MeasureAlgorithm(nothing, [&]() { serialSum = std::accumulate(first, last, uint64_t(0)); });
+		long long parallelTime = MeasureAlgorithm(nothing, [&]()
+			{
+				parallelSum = ParallelReduce(jobsystem, 0, size, uint64_t(0), [&input](size_t i) { return uint64_t(input[i]); }, std::plus<uint64_t>());
+			});
+		ReportAlgorithm("reduce", size, serialTime, parallelTime, serialSum == parallelSum);
+
+		//32 bit prefix sums wrap around the same way in both, which is good enough to compare them.
+		serialTime = MeasureAlgorithm(nothing, [&]() { std::inclusive_scan(first, last, serialKeys.begin(), std::plus<uint32_t>()); });
+		parallelTime = MeasureAlgorithm(nothing, [&]() { ParallelInclusiveScan(jobsystem, first, last, parallelKeys.begin(), std::plus<uint32_t>()); });
+		ReportAlgorithm("inclusive scan", size, serialTime, parallelTime, std::equal(serialKeys.begin(), serialKeys.begin() + size, parallelKeys.begin()));
+
+		serialTime = MeasureAlgorithm(nothing, [&]() { std::exclusive_scan(first, last, serialSums.begin(), uint64_t(0), std::plus<uint64_t>()); });
+		parallelTime = MeasureAlgorithm(nothing, [&]() { ParallelExclusiveScan(jobsystem, first, last, parallelSums.begin(), uint64_t(0), std::plus<uint64_t>()); });
+		ReportAlgorithm("exclusive scan", size, serialTime, parallelTime, std::equal(serialSums.begin(), serialSums.begin() + size, parallelSums.begin()));
+
+		serialTime = MeasureAlgorithm([&]() { std::copy(first, last, serialKeys.begin()); }, [&]() { std::stable_sort(serialKeys.begin(), serialKeys.begin() + size); });
+		parallelTime = MeasureAlgorithm([&]() { std::copy(first, last, parallelKeys.begin()); }, [&]() { ParallelSort(jobsystem, parallelKeys.begin(), parallelKeys.begin() + size); });
+		ReportAlgorithm("sort", size, serialTime, parallelTime, std::equal(serialKeys.begin(), serialKeys.begin() + size, parallelKeys.begin()));
+	}
+	jobsystem.JoinJobs();
+}
+#endif // PARALLEL_ALGORITHMS_BENCHMARK
+
+#ifdef TASK_BENCHMARK
+//Work of a leaf of the trees, so the workers have something to do besides waiting.
+static uint64_t ComputeLeaf(uint64_t seed)
+{
+	uint64_t random = seed * 0x9E3779B97F4A7C15ull + 1;
+	uint64_t sum = 0;
+	for (int i = 0; i < TASK_BENCHMARK_LEAF_ITERATIONS; ++i)
+	{
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		sum += random & 0xFF;
+	}
+	return sum;
+}
+
+static Task<uint64_t> SumTaskTree(JobSystem& jobsystem, unsigned int depth, uint64_t seed)
+{
+	if (depth == 0)
+	{
+		co_return ComputeLeaf(seed);
+	}
+	Task<uint64_t> left = SumTaskTree(jobsystem, depth - 1, seed * 2);
+	Task<uint64_t> right = SumTaskTree(jobsystem, depth - 1, seed * 2 + 1);
+	co_await WhenAll(jobsystem, left, right);
+	co_return left.GetResult() + right.GetResult();
+}
+
+//Continues in a job of its own before computing the leaf, so the leaves of a WhenAny race on different workers.
+static Task<uint64_t> ScheduledLeafTask(JobSystem& jobsystem, uint64_t seed)
+{
+	co_await Schedule(jobsystem);
+	co_return ComputeLeaf(seed);
+}
+
+//Completes with the index of the first leaf to complete and its result, the other leaves keep running on the counter.
+static Task<std::pair<size_t, uint64_t>> FirstLeafTask(JobSystem& jobsystem, std::vector<Task<uint64_t>>& leaves, JobCounter& counter)
+{
+	size_t index = co_await WhenAny(jobsystem, leaves, counter);
+	co_return std::make_pair(index, leaves[index].GetResult());
+}
+
+static uint64_t SumJobTree(JobSystem& jobsystem, unsigned int depth, uint64_t seed)
+{
+	if (depth == 0)
+	{
+		return ComputeLeaf(seed);
+	}
+	uint64_t sums[2] = {};
+	JobCounter counter;
+	for (uint64_t child = 0; child < 2; ++child)
+	{
+		uint64_t* sum = &sums[child];
+		jobsystem.AddJob(jobsystem.CreateJob([&jobsystem, sum, depth, seed, child]() { *sum = SumJobTree(jobsystem, depth - 1, seed * 2 + child); }), &counter);
+	}
+	jobsystem.WaitForCounter(counter);
+	return sums[0] + sums[1];
+}
+
+void RunTaskBenchmark(int inputThreadCount)
+{
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, inputThreadCount);
+	long long taskTime = 0;
+	long long jobTime = 0;
+	for (int i = 0; i < TASK_BENCHMARK_REPETITIONS; ++i)
+	{
+		FrameArena* arena = jobsystem.BeginFrame();
+		auto start = std::chrono::steady_clock::now();
+		uint64_t taskSum = 0;
+		{
+			//The tasks have to be gone before the frame ends, as they live in its arena.
+			Task<uint64_t> root = SumTaskTree(jobsystem, TASK_BENCHMARK_DEPTH, 1);
+			taskSum = WaitForTask(jobsystem, root);
+		}
+		auto middle = std::chrono::steady_clock::now();
+		uint64_t jobSum = SumJobTree(jobsystem, TASK_BENCHMARK_DEPTH, 1);
+		auto end = std::chrono::steady_clock::now();
+		std::pair<size_t, uint64_t> firstLeaf;
+		{
+			//The leaves losing the race are still running once the first one is reported and have to finish before
+			//they are destroyed.
+			std::vector<Task<uint64_t>> leaves;
+			for (uint64_t leaf = 0; leaf < TASK_BENCHMARK_RACE_LEAF_COUNT; ++leaf)
+			{
+				leaves.push_back(ScheduledLeafTask(jobsystem, leaf));
+			}
+			JobCounter counter;
+			Task<std::pair<size_t, uint64_t>> first = FirstLeafTask(jobsystem, leaves, counter);
+			firstLeaf = WaitForTask(jobsystem, first);
+			jobsystem.WaitForCounter(counter);
+		}
+		jobsystem.EndFrame(arena);
+		taskTime += std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count();
+		jobTime += std::chrono::duration_cast<std::chrono::microseconds>(end - middle).count();
+		if (taskSum != jobSum)
+		{
+			PRINT_ESSENTIAL(("Task benchmark got a sum of " + std::to_string(taskSum) + " from the tasks and " + std::to_string(jobSum) + " from the jobs.\n").c_str());
+			exit(1);
+		}
+		if (firstLeaf.first >= TASK_BENCHMARK_RACE_LEAF_COUNT || firstLeaf.second != ComputeLeaf(firstLeaf.first))
+		{
+			PRINT_ESSENTIAL(("Task benchmark got " + std::to_string(firstLeaf.second) + " from leaf " + std::to_string(firstLeaf.first) + " winning the race.\n").c_str());
+			exit(1);
+		}
+	}
+	PRINT_ESSENTIAL(("Task benchmark with " + std::to_string(1 << TASK_BENCHMARK_DEPTH) + " leaves: tasks " + std::to_string(taskTime / TASK_BENCHMARK_REPETITIONS) +
+		"us, jobs " + std::to_string(jobTime / TASK_BENCHMARK_REPETITIONS) + "us.\n").c_str());
+	jobsystem.JoinJobs();
+}
+#endif // TASK_BENCHMARK
+
+#ifdef JOB_HANDLE_BENCHMARK
+//Value computed by the first job of a chain, cheap so mostly the overhead of the jobs gets measured.
+static uint64_t ComputeChainValue(uint64_t chain)
+{
+	return chain * 0x9E3779B97F4A7C15ull >> 16;
+}
+
+void RunJobHandleBenchmark(int inputThreadCount)
+{
+	std::atomic<bool> isRunning = true;
+	JobSystem jobsystem(isRunning, inputThreadCount);
+	uint64_t expectedSum = 0;
+	for (uint64_t chain = 0; chain < JOB_HANDLE_BENCHMARK_CHAIN_COUNT; ++chain)
+	{
+		expectedSum += ComputeChainValue(chain) + 1;
+	}
+	long long handleTime = 0;
+	long long jobTime = 0;
+	for (int i = 0; i < JOB_HANDLE_BENCHMARK_REPETITIONS; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		uint64_t handleSum = 0;
+		{
+			//Even chains are collected with Get, odd ones store their result with a third job returning nothing and are
+			//collected with Wait. The handles have to be gone before the measurement ends, as they free the jobs.
+			std::vector<JobHandle<uint64_t>> valueHandles;
+			std::vector<JobHandle<void>> storeHandles;
+			std::vector<uint64_t> storedValues(JOB_HANDLE_BENCHMARK_CHAIN_COUNT, 0);
+			for (uint64_t chain = 0; chain < JOB_HANDLE_BENCHMARK_CHAIN_COUNT; ++chain)
+			{
+				JobHandle<uint64_t> value = CreateJobWithResult(jobsystem, [chain]() { return ComputeChainValue(chain); });
+				Job* valueJob = value.GetJob();
+				//Every other pair of chains adds its first job before Then, so it may be finished already when the
+				//dependent is set up, the others only add it once the dependent is added.
+				bool isValueAddedFirst = (chain / 2) % 2 == 0;
+				if (isValueAddedFirst)
+				{
+					jobsystem.AddJob(valueJob);
+				}
+				JobHandle<uint64_t> incremented = std::move(value).Then([](uint64_t& result) { return result + 1; });
+				jobsystem.AddJob(incremented.GetJob());
+				if (chain % 2 == 0)
+				{
+					valueHandles.push_back(std::move(incremented));
+				}
+				else
+				{
+					uint64_t* storedValue = &storedValues[chain];
+					JobHandle<void> store = std::move(incremented).Then([storedValue](uint64_t& result) { *storedValue = result; });
+					jobsystem.AddJob(store.GetJob());
+					storeHandles.push_back(std::move(store));
+				}
+				if (!isValueAddedFirst)
+				{
+					jobsystem.AddJob(valueJob);
+				}
+			}
+			for (JobHandle<uint64_t>& handle : valueHandles)
+			{
+				handleSum += handle.Get();
+			}
+			for (JobHandle<void>& handle : storeHandles)
+			{
+				handle.Wait();
+			}
+			for (uint64_t chain = 1; chain < JOB_HANDLE_BENCHMARK_CHAIN_COUNT; chain += 2)
+			{
+				handleSum += storedValues[chain];
+			}
+		}
+		auto middle = std::chrono::steady_clock::now();
+		//The same chains of two jobs, passing the value through memory of their own and waiting for a counter.
+		std::vector<uint64_t> values(JOB_HANDLE_BENCHMARK_CHAIN_COUNT, 0);
+		JobCounter counter;
+		for (uint64_t chain = 0; chain < JOB_HANDLE_BENCHMARK_CHAIN_COUNT; ++chain)
+		{
+			uint64_t* value = &values[chain];
+			Job* valueJob = jobsystem.CreateJob([value, chain]() { *value = ComputeChainValue(chain); });
+			Job* incrementJob = jobsystem.CreateJob([value]() { *value += 1; });
+			jobsystem.AddDependency(incrementJob, valueJob);
+			jobsystem.AddJob(incrementJob, &counter);
+			jobsystem.AddJob(valueJob);
+		}
+		jobsystem.WaitForCounter(counter);
+		uint64_t jobSum = std::accumulate(values.begin(), values.end(), uint64_t(0));
+		auto end = std::chrono::steady_clock::now();
+		handleTime += std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count();
+		jobTime += std::chrono::duration_cast<std::chrono::microseconds>(end - middle).count();
+		if (handleSum != expectedSum || jobSum != expectedSum)
+		{
+			PRINT_ESSENTIAL(("Job handle benchmark got a sum of " + std::to_string(handleSum) + " from the handles and " + std::to_string(jobSum) +
+				" from the jobs, expected " + std::to_string(expectedSum) + ".\n").c_str());
+			exit(1);
+		}
+	}
+	PRINT_ESSENTIAL(("Job handle benchmark with " + std::to_string(JOB_HANDLE_BENCHMARK_CHAIN_COUNT) + " chains: handles " + std::to_string(handleTime / JOB_HANDLE_BENCHMARK_REPETITIONS) +
+		"us, jobs " + std::to_string(jobTime / JOB_HANDLE_BENCHMARK_REPETITIONS) + "us.\n").c_str());
+	jobsystem.JoinJobs();
+}
+#endif // JOB_HANDLE_BENCHMARK
@@ -0,0 +1,63 @@
+#pragma once
+#include "Settings.h"
+
+//Stress tests and benchmarks of the job system. Each of them is enabled by its own flag in Settings.h and run by the
+//main runner before the normal behaviour starts.
+
+#ifdef WAKE_UP_STRESS_TEST
+//Runs WAKE_UP_STRESS_CYCLES cycles of submitting work to idle workers and waiting for it to be done. If no cycle
+//finishes for WAKE_UP_STRESS_DEADLINE_MS a wake up got lost, which is reported before exiting the application.
+void RunWakeUpStressTest(int inputThreadCount);
+#endif // WAKE_UP_STRESS_TEST
+
+#ifdef NESTED_WAIT_STRESS_TEST
+//Runs NESTED_WAIT_STRESS_CYCLES cycles of a parent job waiting for a job depending on one that is not attached to the
+//counter it waits for and for the result of a JobHandle, next to a sibling waiting for the parent, which therefore must
+//not run on top of it. Once with a single worker, which has to do all of it, and once with inputThreadCount workers.
+//If no cycle finishes for NESTED_WAIT_STRESS_DEADLINE_MS the wait deadlocked, which is reported before exiting the
+//application.
+void RunNestedWaitStressTest(int inputThreadCount);
+#endif // NESTED_WAIT_STRESS_TEST
+
+#ifdef STEAL_BENCHMARK
+//Runs STEAL_BENCHMARK_FRAME_COUNT frames, each spawning STEAL_BENCHMARK_PARTICLE_JOB_COUNT particle jobs from a single
+//worker, so all other workers have to steal them. Reports the average frame time, the steal counts are reported when
+//the workers join. Compare runs with different STEAL_BATCH_SIZE values.
+void RunStealBenchmark(int inputThreadCount);
+#endif // STEAL_BENCHMARK
+
+#ifdef TOPOLOGY_BENCHMARK
+//Runs TOPOLOGY_BENCHMARK_FRAME_COUNT frames, each with a job writing a buffer and spawning TOPOLOGY_BENCHMARK_CHILD_COUNT
+//children reading a chunk of it. Reports for the children stolen by other workers how long it took from being added to
+//being started and how long reading the chunk took, which grows the fewer caches the thief shares with the parent.
+void RunTopologyBenchmark(int inputThreadCount);
+#endif // TOPOLOGY_BENCHMARK
+
+#ifdef PARALLEL_FOR_BENCHMARK
+//Integrates particles with a serial loop, a ParallelFor with PARALLEL_FOR_BENCHMARK_GRAIN_SIZE and a ParallelFor
+//picking its grain size automatically, from 1000 up to PARALLEL_FOR_BENCHMARK_MAX_ITERATIONS particles. Reports the
+//average time of each.
+void RunParallelForBenchmark(int inputThreadCount);
+#endif // PARALLEL_FOR_BENCHMARK
+
+#ifdef PARALLEL_ALGORITHMS_BENCHMARK
+//Compares ParallelReduce, ParallelInclusiveScan, ParallelExclusiveScan and ParallelSort with std::accumulate,
+//std::inclusive_scan, std::exclusive_scan and std::stable_sort, from 1000 up to PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE
+//elements. Reports the average time of each and exits the application if a result differs.
+void RunParallelAlgorithmsBenchmark(int inputThreadCount);
+#endif // PARALLEL_ALGORITHMS_BENCHMARK
+
+#ifdef TASK_BENCHMARK
+//Sums up a binary tree with TASK_BENCHMARK_DEPTH levels, once as coroutine tasks awaiting their children with WhenAll
+//and once as jobs waiting for their children with WaitForCounter. The tasks are created inside a frame, so their frames
+//come from its arena. Afterwards TASK_BENCHMARK_RACE_LEAF_COUNT leaves moved to jobs of their own with Schedule race in
+//a WhenAny. Reports the average time of each tree and exits the application if the sums or the winning leaf differ.
+void RunTaskBenchmark(int inputThreadCount);
+#endif // TASK_BENCHMARK
+
+#ifdef JOB_HANDLE_BENCHMARK
+//Runs JOB_HANDLE_BENCHMARK_CHAIN_COUNT chains of a job computing a value and a dependent set up with JobHandle::Then
+//adding one to it, once with handles collecting the results with Get and Wait and once with plain jobs and a counter.
+//Reports the average time of each and exits the application if a sum differs.
+void RunJobHandleBenchmark(int inputThreadCount);
+#endif // JOB_HANDLE_BENCHMARK
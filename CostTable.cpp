@@ -0,0 +1,73 @@
+#include "CostTable.h"
+#include <cstdint>
+
+CostTable::CostTable()
+{
+	for (Entry& entry : entries)
+	{
+		entry.key = nullptr;
+		entry.cost = 0;
+	}
+}
+
+unsigned int CostTable::Get(const void* key, unsigned int estimatedCost)
+{
+	Entry* entry = Find(key, false);
+	if (entry)
+	{
+		unsigned int cost = entry->cost.load(std::memory_order_relaxed);
+		if (cost > 0)
+		{
+			return cost;
+		}
+	}
+	return estimatedCost;
+}
+
+void CostTable::Record(const void* key, unsigned int measuredCost)
+{
+	Entry* entry = Find(key, true);
+	if (!entry)
+	{
+		return;
+	}
+	//Costs are never 0, so 0 can mark entries that were not measured yet.
+	measuredCost = measuredCost > 0 ? measuredCost : 1;
+	unsigned int cost = entry->cost.load(std::memory_order_relaxed);
+	if (cost > 0)
+	{
+		//Exponential moving average, so single outliers do not throw off the estimate. Concurrent records of the same
+		//key can overwrite each other, which only loses a measurement.
+		cost = static_cast<unsigned int>(static_cast<int64_t>(cost) + (static_cast<int64_t>(measuredCost) - cost) / 4);
+		measuredCost = cost > 0 ? cost : 1;
+	}
+	entry->cost.store(measuredCost, std::memory_order_relaxed);
+}
+
+CostTable::Entry* CostTable::Find(const void* key, bool insert)
+{
+	//Fibonacci hashing spreads the mostly aligned addresses used as keys over the table.
+	size_t index = static_cast<size_t>((static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key)) * 11400714819323198485ull) >> 40) % COST_TABLE_SIZE;
+	for (size_t i = 0; i < COST_TABLE_SIZE; ++i)
+	{
+		Entry& entry = entries[(index + i) % COST_TABLE_SIZE];
+		const void* entryKey = entry.key.load(std::memory_order_acquire);
+		if (entryKey == key)
+		{
+			return &entry;
+		}
+		if (!entryKey)
+		{
+			if (!insert)
+			{
+				return nullptr;
+			}
+			//Keys are never removed, so once an entry is taken it stays with its key.
+			if (entry.key.compare_exchange_strong(entryKey, key, std::memory_order_acq_rel) || entryKey == key)
+			{
+				return &entry;
+			}
+		}
+	}
+	return nullptr;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <atomic>
+#include "Settings.h"
+
+//CostTable learns how long jobs take, so the scheduler can estimate the cost of a job from previous frames. Jobs are
+//identified by a key chosen by the user (like the function they run). The table is a fixed size open addressing hash
+//table that is never shrunk, keys that do not fit anymore are simply not learned.
+class CostTable
+{
+public:
+	CostTable();
+	//Returns the learned cost for the key, or the given estimate if nothing was learned for it yet. Can be called from
+	//any thread.
+	unsigned int Get(const void* key, unsigned int estimatedCost);
+	//Adds a measured cost of a job with the given key. Can be called from any thread.
+	void Record(const void* key, unsigned int measuredCost);
+private:
+	struct Entry
+	{
+		std::atomic<const void*> key;
+		//Moving average of the measured costs, 0 if nothing was measured yet.
+		std::atomic<unsigned int> cost;
+	};
+
+	//Returns the entry of the key or nullptr if the key is not in the table. If insert is true, a free entry is taken for
+	//a key not in the table yet.
+	Entry* Find(const void* key, bool insert);
+
+	Entry entries[COST_TABLE_SIZE];
+};
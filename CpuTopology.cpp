@@ -0,0 +1,362 @@
+#include "CpuTopology.h"
+#include <algorithm>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+
+//Assigns the id to every CPU in the mask.
+static void AssignId(std::vector<CpuInfo>& cpus, ULONG_PTR mask, int CpuInfo::* member, int id)
+{
+	for (CpuInfo& cpu : cpus)
+	{
+		if (cpu.id < sizeof(ULONG_PTR) * 8 && (mask >> cpu.id) & 1)
+		{
+			cpu.*member = id;
+		}
+	}
+}
+
+static std::vector<CpuInfo> ReadCpus()
+{
+	std::vector<CpuInfo> cpus;
+	DWORD length = 0;
+	GetLogicalProcessorInformation(nullptr, &length);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> infos(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if (infos.empty() || !GetLogicalProcessorInformation(infos.data(), &length))
+	{
+		return cpus;
+	}
+	ULONG_PTR allCpus = 0;
+	for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& info : infos)
+	{
+		if (info.Relationship == RelationProcessorCore)
+		{
+			allCpus |= info.ProcessorMask;
+		}
+	}
+	for (unsigned int id = 0; id < sizeof(ULONG_PTR) * 8; ++id)
+	{
+		if ((allCpus >> id) & 1)
+		{
+			CpuInfo cpu;
+			cpu.id = id;
+			cpus.push_back(cpu);
+		}
+	}
+	//The entries are not numbered, so they are simply counted.
+	int coreCount = 0;
+	int packageCount = 0;
+	int cacheCount = 0;
+	for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& info : infos)
+	{
+		switch (info.Relationship)
+		{
+		case RelationProcessorCore:
+			AssignId(cpus, info.ProcessorMask, &CpuInfo::coreId, coreCount++);
+			break;
+		case RelationProcessorPackage:
+			AssignId(cpus, info.ProcessorMask, &CpuInfo::packageId, packageCount++);
+			break;
+		case RelationCache:
+			if (info.Cache.Level == 2)
+			{
+				AssignId(cpus, info.ProcessorMask, &CpuInfo::l2CacheId, cacheCount++);
+			}
+			else if (info.Cache.Level == 3)
+			{
+				AssignId(cpus, info.ProcessorMask, &CpuInfo::l3CacheId, cacheCount++);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	for (CpuInfo& cpu : cpus)
+	{
+		UCHAR node = 0;
+		if (GetNumaProcessorNode(static_cast<UCHAR>(cpu.id), &node) && node != 0xFF)
+		{
+			cpu.numaNode = node;
+		}
+	}
+	return cpus;
+}
+
+bool CpuTopology::PinCurrentThread(const CpuInfo& cpu)
+{
+	if (cpu.id >= sizeof(DWORD_PTR) * 8)
+	{
+		return false;
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu.id) != 0;
+}
+
+int CpuTopology::GetMemoryNode(const void* address)
+{
+	PSAPI_WORKING_SET_EX_INFORMATION info = {};
+	info.VirtualAddress = const_cast<void*>(address);
+	if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid)
+	{
+		return -1;
+	}
+	return static_cast<int>(info.VirtualAttributes.Node);
+}
+#elif defined(__linux__)
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//Flags of get_mempolicy, which is called directly so there is no dependency on libnuma.
+#define MPOL_F_NODE 1
+#define MPOL_F_ADDR 2
+
+//Parses a CPU list like "0-3,8-11".
+static std::vector<unsigned int> ParseCpuList(const std::string& list)
+{
+	std::vector<unsigned int> ids;
+	size_t position = 0;
+	while (position < list.size())
+	{
+		size_t end = list.find(',', position);
+		if (end == std::string::npos)
+		{
+			end = list.size();
+		}
+		std::string range = list.substr(position, end - position);
+		size_t dash = range.find('-');
+		try
+		{
+			unsigned int first = static_cast<unsigned int>(std::stoul(range.substr(0, dash)));
+			unsigned int last = dash == std::string::npos ? first : static_cast<unsigned int>(std::stoul(range.substr(dash + 1)));
+			for (unsigned int id = first; id <= last; ++id)
+			{
+				ids.push_back(id);
+			}
+		}
+		catch (const std::exception&)
+		{
+			//Skips anything that is not a number, like the trailing new line.
+		}
+		position = end + 1;
+	}
+	return ids;
+}
+
+static bool ReadLine(const std::string& path, std::string& line)
+{
+	std::ifstream file(path);
+	return file && std::getline(file, line) && !line.empty();
+}
+
+static int ReadId(const std::string& path)
+{
+	std::string line;
+	if (!ReadLine(path, line))
+	{
+		return -1;
+	}
+	try
+	{
+		return std::stoi(line);
+	}
+	catch (const std::exception&)
+	{
+		return -1;
+	}
+}
+
+static std::vector<CpuInfo> ReadCpus()
+{
+	std::vector<CpuInfo> cpus;
+	std::string online;
+	if (!ReadLine("/sys/devices/system/cpu/online", online))
+	{
+		return cpus;
+	}
+	for (unsigned int id : ParseCpuList(online))
+	{
+		std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(id);
+		CpuInfo cpu;
+		cpu.id = id;
+		cpu.packageId = ReadId(path + "/topology/physical_package_id");
+		int coreId = ReadId(path + "/topology/core_id");
+		//Core ids are only unique within a package.
+		cpu.coreId = coreId >= 0 ? std::max(cpu.packageId, 0) * 65536 + coreId : -1;
+		//A cache is identified by the first CPU sharing it.
+		for (int index = 0; ; ++index)
+		{
+			std::string cachePath = path + "/cache/index" + std::to_string(index);
+			int level = ReadId(cachePath + "/level");
+			if (level < 0)
+			{
+				break;
+			}
+			std::string sharedCpus;
+			std::string type;
+			if (level < 2 || !ReadLine(cachePath + "/shared_cpu_list", sharedCpus) || (ReadLine(cachePath + "/type", type) && type == "Instruction"))
+			{
+				continue;
+			}
+			std::vector<unsigned int> sharingIds = ParseCpuList(sharedCpus);
+			int cacheId = sharingIds.empty() ? -1 : static_cast<int>(*std::min_element(sharingIds.begin(), sharingIds.end()));
+			(level == 2 ? cpu.l2CacheId : cpu.l3CacheId) = cacheId;
+		}
+		cpus.push_back(cpu);
+	}
+	//Machines without NUMA support in the kernel have no node directory, their CPUs stay on an unknown node.
+	std::string onlineNodes;
+	if (ReadLine("/sys/devices/system/node/online", onlineNodes))
+	{
+		for (unsigned int node : ParseCpuList(onlineNodes))
+		{
+			std::string nodeCpus;
+			if (!ReadLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", nodeCpus))
+			{
+				continue;
+			}
+			for (unsigned int id : ParseCpuList(nodeCpus))
+			{
+				for (CpuInfo& cpu : cpus)
+				{
+					if (cpu.id == id)
+					{
+						cpu.numaNode = static_cast<int>(node);
+					}
+				}
+			}
+		}
+	}
+	return cpus;
+}
+
+bool CpuTopology::PinCurrentThread(const CpuInfo& cpu)
+{
+	if (cpu.id >= CPU_SETSIZE)
+	{
+		return false;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu.id, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int CpuTopology::GetMemoryNode(const void* address)
+{
+	int node = -1;
+	if (syscall(SYS_get_mempolicy, &node, nullptr, 0, const_cast<void*>(address), MPOL_F_NODE | MPOL_F_ADDR) != 0)
+	{
+		return -1;
+	}
+	return node;
+}
+#else
+static std::vector<CpuInfo> ReadCpus()
+{
+	return std::vector<CpuInfo>();
+}
+
+bool CpuTopology::PinCurrentThread([[maybe_unused]] const CpuInfo& cpu)
+{
+	return false;
+}
+
+int CpuTopology::GetMemoryNode([[maybe_unused]] const void* address)
+{
+	return -1;
+}
+#endif
+
+CpuTopology::CpuTopology() : cpus(ReadCpus())
+{
+	if (cpus.empty())
+	{
+		unsigned int cpuCount = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned int id = 0; id < cpuCount; ++id)
+		{
+			CpuInfo cpu;
+			cpu.id = id;
+			cpu.coreId = static_cast<int>(id);
+			cpus.push_back(cpu);
+		}
+	}
+}
+
+const std::vector<CpuInfo>& CpuTopology::GetCpus() const
+{
+	return cpus;
+}
+
+CpuDistance CpuTopology::GetDistance(const CpuInfo& a, const CpuInfo& b) const
+{
+	if (a.id == b.id)
+	{
+		return CpuDistance::Same;
+	}
+	if (a.coreId >= 0 && a.coreId == b.coreId)
+	{
+		return CpuDistance::SmtSibling;
+	}
+	if (a.l2CacheId >= 0 && a.l2CacheId == b.l2CacheId)
+	{
+		return CpuDistance::SharedL2;
+	}
+	if (a.l3CacheId >= 0 && a.l3CacheId == b.l3CacheId)
+	{
+		return CpuDistance::SharedL3;
+	}
+	//Packages can be split into multiple nodes, which makes their memory remote to each other as well.
+	if (a.numaNode >= 0 && b.numaNode >= 0 && a.numaNode != b.numaNode)
+	{
+		return CpuDistance::Remote;
+	}
+	//Without package information the CPUs are assumed to be in the same one.
+	if (a.packageId == b.packageId)
+	{
+		return CpuDistance::SamePackage;
+	}
+	return CpuDistance::Remote;
+}
+
+std::vector<CpuInfo> CpuTopology::PickWorkerCpus(unsigned int workerCount) const
+{
+	//Sorting by node, package, caches and core puts CPUs sharing caches next to each other.
+	std::vector<CpuInfo> sorted = cpus;
+	std::stable_sort(sorted.begin(), sorted.end(), [](const CpuInfo& a, const CpuInfo& b)
+		{
+			return std::tie(a.numaNode, a.packageId, a.l3CacheId, a.l2CacheId, a.coreId) < std::tie(b.numaNode, b.packageId, b.l3CacheId, b.l2CacheId, b.coreId);
+		});
+	//The first hardware thread of every core comes first, further ones after all cores are taken.
+	std::vector<std::pair<unsigned int, CpuInfo>> ranked;
+	for (size_t i = 0; i < sorted.size(); ++i)
+	{
+		unsigned int threadIndex = 0;
+		for (size_t j = 0; j < i; ++j)
+		{
+			if (sorted[j].coreId >= 0 && sorted[j].coreId == sorted[i].coreId)
+			{
+				threadIndex++;
+			}
+		}
+		ranked.emplace_back(threadIndex, sorted[i]);
+	}
+	std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<unsigned int, CpuInfo>& a, const std::pair<unsigned int, CpuInfo>& b)
+		{
+			return a.first < b.first;
+		});
+	std::vector<CpuInfo> workerCpus;
+	for (unsigned int i = 0; i < workerCount; ++i)
+	{
+		workerCpus.push_back(ranked[i % ranked.size()].second);
+	}
+	return workerCpus;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <vector>
+
+//How close two logical CPUs are to each other. The closer they are, the more caches they share, so the cheaper it is for
+//one of them to work on data the other one just touched.
+enum class CpuDistance : unsigned char
+{
+	Same = 0,
+	//Hardware threads of the same core, sharing everything down to the L1 cache
+	SmtSibling = 1,
+	SharedL2 = 2,
+	SharedL3 = 3,
+	SamePackage = 4,
+	//Another package or another NUMA node, so memory local to one of them is remote to the other one
+	Remote = 5,
+};
+
+//Where a logical CPU sits in the machine. Ids are only meaningful for comparing CPUs, -1 means unknown.
+struct CpuInfo
+{
+	//Id used to pin threads to the CPU
+	unsigned int id = 0;
+	int coreId = -1;
+	int packageId = -1;
+	int l2CacheId = -1;
+	int l3CacheId = -1;
+	int numaNode = -1;
+};
+
+//CpuTopology reads which logical CPUs share cores, caches, packages and NUMA nodes. On Linux it is parsed from
+///sys/devices/system/cpu, on Windows it comes from GetLogicalProcessorInformation (which only covers the processor group
+//of the calling thread, so at most 64 CPUs). If it can not be read, every CPU is taken as a core of its own.
+class CpuTopology
+{
+public:
+	CpuTopology();
+	const std::vector<CpuInfo>& GetCpus() const;
+	CpuDistance GetDistance(const CpuInfo& a, const CpuInfo& b) const;
+	//Picks the CPUs for the given number of workers. CPUs of the same NUMA node and sharing caches are picked next to each
+	//other, but every core gets one worker before a second hardware thread of a core is used. Wraps around if there are
+	//more workers than CPUs.
+	std::vector<CpuInfo> PickWorkerCpus(unsigned int workerCount) const;
+	//Pins the calling thread to the given CPU. Returns false if that is not supported or failed.
+	static bool PinCurrentThread(const CpuInfo& cpu);
+	//NUMA node the memory at the given address is placed on, -1 if unknown. Memory that was not touched yet is not placed
+	//anywhere, it ends up on the node of the thread touching it first.
+	static int GetMemoryNode(const void* address);
+private:
+	std::vector<CpuInfo> cpus;
+};
@@ -0,0 +1,49 @@
+#include "EventCount.h"
+#include "Futex.h"
+
+EventCount::EventCount() : epoch(0), waiters(0) {}
+
+uint32_t EventCount::PrepareWait()
+{
+	waiters.fetch_add(1, std::memory_order_seq_cst);
+	//Pairs with the fence in Notify: either the notifier sees us waiting, or we see the changed condition after this.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return epoch.load(std::memory_order_acquire);
+}
+
+void EventCount::CancelWait()
+{
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventCount::Wait(uint32_t key)
+{
+	//Futex waits can return spuriously, so only stop once the epoch actually moved on.
+	while (epoch.load(std::memory_order_acquire) == key)
+	{
+		FutexWait(epoch, key);
+	}
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventCount::NotifyOne()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiters.load(std::memory_order_relaxed) == 0)
+	{
+		return;
+	}
+	epoch.fetch_add(1, std::memory_order_release);
+	FutexWakeOne(epoch);
+}
+
+void EventCount::NotifyAll()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiters.load(std::memory_order_relaxed) == 0)
+	{
+		return;
+	}
+	epoch.fetch_add(1, std::memory_order_release);
+	FutexWakeAll(epoch);
+}
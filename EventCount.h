@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(_M_ARM64)
+#include <intrin.h>
+#endif
+
+//Tells the CPU we are in a spin loop, which saves power and frees resources for the SMT sibling.
+inline void CpuRelax()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#elif defined(_M_ARM64)
+	__yield();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+//EventCount lets threads sleep until some condition becomes true, without the condition being protected by a lock.
+//A waiter registers with PrepareWait, checks its condition once more and only then calls Wait (or CancelWait if the
+//condition became true). Anyone making the condition true calls NotifyOne/NotifyAll afterwards. Notifications are
+//nearly free while nobody is waiting, as they only go to the kernel if there actually is a registered waiter.
+class EventCount
+{
+public:
+	EventCount();
+	//Registers the calling thread as waiter and returns the key for Wait.
+	uint32_t PrepareWait();
+	//Unregisters the calling thread without waiting.
+	void CancelWait();
+	//Blocks until a notification happened after the PrepareWait returning key. Unregisters the calling thread.
+	void Wait(uint32_t key);
+	void NotifyOne();
+	void NotifyAll();
+private:
+	//Incremented by every notification that found a waiter. Waiters sleep on it using a futex.
+	std::atomic<uint32_t> epoch;
+	std::atomic<uint32_t> waiters;
+};
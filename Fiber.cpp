@@ -0,0 +1,108 @@
+#include "Fiber.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+Fiber::Fiber() : handle(nullptr), isThreadFiber(true) {}
+
+Fiber::Fiber(size_t stackSize, Entry entry, void* argument) : entry(entry), argument(argument)
+{
+	handle = CreateFiber(stackSize, reinterpret_cast<LPFIBER_START_ROUTINE>(&Fiber::Start), this);
+}
+
+Fiber::~Fiber()
+{
+	if (handle && !isThreadFiber)
+	{
+		DeleteFiber(handle);
+	}
+}
+
+Fiber* Fiber::ConvertCurrentThread()
+{
+	Fiber* fiber = new Fiber();
+	fiber->handle = ConvertThreadToFiber(nullptr);
+	return fiber;
+}
+
+void Fiber::RevertCurrentThread(Fiber* threadFiber)
+{
+	ConvertFiberToThread();
+	delete threadFiber;
+}
+
+void Fiber::Switch(Fiber* from, Fiber* to)
+{
+	//The state of from is saved by SwitchToFiber itself.
+	SwitchToFiber(to->handle);
+}
+
+uint64_t Fiber::GetCurrentThreadId()
+{
+	return ::GetCurrentThreadId();
+}
+
+void __stdcall Fiber::Start(void* fiber)
+{
+	Fiber* self = static_cast<Fiber*>(fiber);
+	self->entry(self->argument);
+}
+#else
+#include <cstdlib>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <pthread.h>
+#endif
+
+Fiber::Fiber() {}
+
+Fiber::Fiber(size_t stackSize, Entry entry, void* argument) : entry(entry), argument(argument), stack(new unsigned char[stackSize])
+{
+	getcontext(&context);
+	context.uc_stack.ss_sp = stack.get();
+	context.uc_stack.ss_size = stackSize;
+	//Entries never return, so there is no context to continue with afterwards.
+	context.uc_link = nullptr;
+	uintptr_t self = reinterpret_cast<uintptr_t>(this);
+	makecontext(&context, reinterpret_cast<void (*)()>(&Fiber::Start), 2, static_cast<unsigned int>(static_cast<uint64_t>(self) >> 32), static_cast<unsigned int>(self & 0xFFFFFFFFu));
+}
+
+Fiber::~Fiber() {}
+
+Fiber* Fiber::ConvertCurrentThread()
+{
+	//The context of the thread is only filled in when switching away from it.
+	return new Fiber();
+}
+
+void Fiber::RevertCurrentThread(Fiber* threadFiber)
+{
+	delete threadFiber;
+}
+
+void Fiber::Switch(Fiber* from, Fiber* to)
+{
+	swapcontext(&from->context, &to->context);
+}
+
+uint64_t Fiber::GetCurrentThreadId()
+{
+#if defined(__linux__)
+	return static_cast<uint64_t>(syscall(SYS_gettid));
+#else
+	return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(pthread_self()));
+#endif
+}
+
+void Fiber::Start(unsigned int high, unsigned int low)
+{
+	Fiber* self = reinterpret_cast<Fiber*>(static_cast<uintptr_t>((static_cast<uint64_t>(high) << 32) | low));
+	self->entry(self->argument);
+	//Returning would end the thread running the fiber.
+	abort();
+}
+#endif
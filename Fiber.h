@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#if !defined(_WIN32)
+#include <ucontext.h>
+#endif
+
+//Fiber is an execution context with its own stack, which threads switch between in user space without the kernel being
+//involved. On Windows it uses the fiber API, elsewhere ucontext. A thread has to be converted into a fiber before it can
+//switch to other fibers, and a fiber can be switched to from any thread, as long as it is not running anywhere else.
+class Fiber
+{
+public:
+	typedef void (*Entry)(void* argument);
+
+	//Creates a fiber with a stack of the given size, which runs entry(argument) once it is first switched to. entry must
+	//never return, it has to switch to another fiber instead.
+	Fiber(size_t stackSize, Entry entry, void* argument);
+	~Fiber();
+	Fiber(const Fiber&) = delete;
+	Fiber& operator=(const Fiber&) = delete;
+	//Turns the calling thread into a fiber, so it can switch to other fibers and later be switched back to.
+	static Fiber* ConvertCurrentThread();
+	//Turns the calling thread back into a normal thread and deletes its fiber. The thread has to run on that fiber again.
+	static void RevertCurrentThread(Fiber* threadFiber);
+	//Saves the state of the running fiber from and continues with to. Returns once someone switches back to from, which
+	//can happen on another thread.
+	static void Switch(Fiber* from, Fiber* to);
+	//Id the operating system gives the calling thread, which is what profilers attach fibers to.
+	static uint64_t GetCurrentThreadId();
+private:
+	//Fiber standing for a converted thread, which runs on the stack of the thread.
+	Fiber();
+
+	Entry entry = nullptr;
+	void* argument = nullptr;
+#if defined(_WIN32)
+	static void __stdcall Start(void* fiber);
+
+	void* handle = nullptr;
+	bool isThreadFiber = false;
+#else
+	//makecontext only passes int arguments, so the fiber pointer is split into two halves.
+	static void Start(unsigned int high, unsigned int low);
+
+	ucontext_t context;
+	std::unique_ptr<unsigned char[]> stack;
+#endif
+};
@@ -0,0 +1,48 @@
+#include "FrameArena.h"
+#include <new>
+
+//Memory is aligned to cache lines, so allocations aligned to a cache line really start on one.
+constexpr size_t ARENA_ALIGNMENT = 64;
+
+FrameArena::FrameArena(size_t capacity) : inUse(false), capacity(capacity), offset(0), overflows(0)
+{
+	memory = static_cast<unsigned char*>(operator new(capacity, std::align_val_t(ARENA_ALIGNMENT)));
+}
+
+FrameArena::~FrameArena()
+{
+	operator delete(memory, std::align_val_t(ARENA_ALIGNMENT));
+}
+
+void* FrameArena::Allocate(size_t size, size_t alignment)
+{
+	size_t current = offset.load(std::memory_order_relaxed);
+	size_t start;
+	do
+	{
+		//alignment is always a power of two
+		start = (current + alignment - 1) & ~(alignment - 1);
+		if (start + size > capacity)
+		{
+			overflows.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+	} while (!offset.compare_exchange_weak(current, start + size, std::memory_order_relaxed));
+	return memory + start;
+}
+
+void FrameArena::Reset()
+{
+	offset.store(0, std::memory_order_relaxed);
+	overflows.store(0, std::memory_order_relaxed);
+}
+
+size_t FrameArena::GetUsedBytes() const
+{
+	return offset.load(std::memory_order_relaxed);
+}
+
+size_t FrameArena::GetOverflows() const
+{
+	return overflows.load(std::memory_order_relaxed);
+}
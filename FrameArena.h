@@ -0,0 +1,27 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+//FrameArena is a linear allocator for everything that lives exactly as long as one frame. Allocating only bumps an
+//offset, so it is cheap and thread safe, and all memory of a frame is released at once by resetting that offset.
+//Nothing allocated from the arena is destructed on reset, so users have to destroy their objects themselves.
+class FrameArena
+{
+public:
+	FrameArena(size_t capacity);
+	~FrameArena();
+	//Returns nullptr if the arena does not have enough memory left. Can be called from any thread.
+	void* Allocate(size_t size, size_t alignment);
+	//Releases all allocations in O(1). Must only be called once nothing allocated from the arena is in use anymore.
+	void Reset();
+	size_t GetUsedBytes() const;
+	//How many allocations did not fit into the arena anymore since the last reset.
+	size_t GetOverflows() const;
+	//Set while a frame is using the arena, so overlapping frames do not get the same arena.
+	std::atomic<bool> inUse;
+private:
+	unsigned char* memory;
+	size_t capacity;
+	std::atomic<size_t> offset;
+	std::atomic<size_t> overflows;
+};
@@ -0,0 +1,74 @@
+#include "Futex.h"
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futexes need atomics without any extra state.");
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+
+void FutexWait(std::atomic<uint32_t>& value, uint32_t expected)
+{
+	WaitOnAddress(&value, &expected, sizeof(uint32_t), INFINITE);
+}
+
+void FutexWakeOne(std::atomic<uint32_t>& value)
+{
+	WakeByAddressSingle(&value);
+}
+
+void FutexWakeAll(std::atomic<uint32_t>& value)
+{
+	WakeByAddressAll(&value);
+}
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+
+void FutexWait(std::atomic<uint32_t>& value, uint32_t expected)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+void FutexWakeOne(std::atomic<uint32_t>& value)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+void FutexWakeAll(std::atomic<uint32_t>& value)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+#else
+#include <condition_variable>
+#include <mutex>
+
+//One mutex and condition variable for all addresses. Waking always wakes everyone, which is allowed as callers have to
+//deal with spurious wake ups anyway.
+static std::mutex futexMutex;
+static std::condition_variable futexConditionVariable;
+
+void FutexWait(std::atomic<uint32_t>& value, uint32_t expected)
+{
+	std::unique_lock<std::mutex> lock(futexMutex);
+	//Checking under the lock makes sure a wake between the check and going to sleep can not get lost.
+	if (value.load() == expected)
+	{
+		futexConditionVariable.wait(lock);
+	}
+}
+
+void FutexWakeOne(std::atomic<uint32_t>& value)
+{
+	FutexWakeAll(value);
+}
+
+void FutexWakeAll(std::atomic<uint32_t>&)
+{
+	std::lock_guard<std::mutex> guard(futexMutex);
+	futexConditionVariable.notify_all();
+}
+#endif
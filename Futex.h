@@ -0,0 +1,13 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+//Thin wrappers around the operating system's address based waiting (futex on Linux, WaitOnAddress on Windows). Other
+//platforms fall back to a mutex and condition variable, which behaves the same but is slower.
+
+//Blocks while value still equals expected. Can return spuriously, so callers always have to check their condition again.
+void FutexWait(std::atomic<uint32_t>& value, uint32_t expected);
+//Wakes at most one thread blocked in FutexWait on value.
+void FutexWakeOne(std::atomic<uint32_t>& value);
+//Wakes all threads blocked in FutexWait on value.
+void FutexWakeAll(std::atomic<uint32_t>& value);
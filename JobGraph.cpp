@@ -0,0 +1,175 @@
+#include "JobGraph.h"
+#include <algorithm>
+#include <string>
+
+JobGraph::JobGraph() {}
+
+JobGraph::~JobGraph()
+{
+	//Also deletes the dependent chunks of the jobs.
+	delete[] jobs;
+}
+
+unsigned int JobGraph::AddNode(JobFunction function, JobPriority priority, unsigned int cost)
+{
+	nodes.push_back({ function, priority, std::max(cost, 1u) });
+	return static_cast<unsigned int>(nodes.size() - 1);
+}
+
+void JobGraph::AddDependency(unsigned int dependent, unsigned int dependency)
+{
+	dependencies.emplace_back(dependent, dependency);
+}
+
+bool JobGraph::Compile()
+{
+	unsigned int nodeCount = static_cast<unsigned int>(nodes.size());
+	std::vector<unsigned int> dependencyCountsByNode(nodeCount, 0);
+	std::vector<std::vector<unsigned int>> dependentsByNode(nodeCount);
+	for (const auto& dependency : dependencies)
+	{
+		if (dependency.first >= nodeCount || dependency.second >= nodeCount)
+		{
+			PRINT_ESSENTIAL(("Job graph has a dependency between nodes " + std::to_string(dependency.first) + " and " +
+				std::to_string(dependency.second) + ", but only " + std::to_string(nodeCount) + " nodes.\n").c_str());
+			return false;
+		}
+		dependentsByNode[dependency.second].push_back(dependency.first);
+		dependencyCountsByNode[dependency.first]++;
+	}
+
+	//Kahn's algorithm: a node is placed once all of its dependencies are placed. If some nodes never get placed, they
+	//wait for each other.
+	std::vector<unsigned int> order;
+	order.reserve(nodeCount);
+	std::vector<unsigned int> remainingDependencies = dependencyCountsByNode;
+	for (unsigned int node = 0; node < nodeCount; ++node)
+	{
+		if (remainingDependencies[node] == 0)
+		{
+			order.push_back(node);
+		}
+	}
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		for (unsigned int dependent : dependentsByNode[order[i]])
+		{
+			if (--remainingDependencies[dependent] == 0)
+			{
+				order.push_back(dependent);
+			}
+		}
+	}
+	if (order.size() != nodeCount)
+	{
+		PRINT_ESSENTIAL(("Job graph has a cycle between " + std::to_string(nodeCount - order.size()) + " of its nodes.\n").c_str());
+		return false;
+	}
+
+	std::vector<unsigned int> positions(nodeCount);
+	for (unsigned int position = 0; position < nodeCount; ++position)
+	{
+		positions[order[position]] = position;
+	}
+	jobs = new Job[nodeCount];
+	dependencyCounts.resize(nodeCount);
+	for (unsigned int position = 0; position < nodeCount; ++position)
+	{
+		unsigned int node = order[position];
+		Job& job = jobs[position];
+		job.invoke = &InvokeFunction;
+		*reinterpret_cast<JobFunction*>(job.payload) = nodes[node].function;
+		job.priority = nodes[node].priority;
+		job.cost = nodes[node].cost;
+		job.persistent = true;
+		for (unsigned int dependent : dependentsByNode[node])
+		{
+			Job* dependentJob = &jobs[positions[dependent]];
+			if (job.dependentCount < MAX_INLINE_DEPENDENT_COUNT)
+			{
+				job.dependents[job.dependentCount] = dependentJob;
+			}
+			else
+			{
+				DependentChunk* chunk = job.dependentChunks;
+				if (!chunk || chunk->count == DEPENDENT_CHUNK_SIZE)
+				{
+					chunk = new DependentChunk();
+					chunk->heapAllocated = true;
+					chunk->next = job.dependentChunks;
+					job.dependentChunks = chunk;
+				}
+				chunk->dependents[chunk->count++] = dependentJob;
+			}
+			job.dependentCount++;
+		}
+		dependencyCounts[position] = dependencyCountsByNode[node];
+		if (dependencyCounts[position] == 0)
+		{
+			roots.push_back(&job);
+		}
+		totalCost += job.cost;
+	}
+	//Going backwards through the topological order, every dependent already knows its path when its dependency needs it.
+	for (unsigned int position = nodeCount; position-- > 0;)
+	{
+		unsigned int longestDependentPath = 0;
+		for (unsigned int dependent : dependentsByNode[order[position]])
+		{
+			longestDependentPath = std::max(longestDependentPath, jobs[positions[dependent]].pathLength);
+		}
+		jobs[position].pathLength = jobs[position].cost + longestDependentPath;
+		criticalPathLength = std::max(criticalPathLength, jobs[position].pathLength);
+	}
+	//The recording is not needed anymore.
+	nodes = std::vector<Node>();
+	dependencies = std::vector<std::pair<unsigned int, unsigned int>>();
+	return true;
+}
+
+bool JobGraph::IsCompiled() const
+{
+	return jobs != nullptr;
+}
+
+unsigned int JobGraph::GetNodeCount() const
+{
+	return static_cast<unsigned int>(dependencyCounts.size());
+}
+
+void JobGraph::Reset(JobCounter* counter, signed char frame)
+{
+	//The counters are published to the workers by pushing the roots, so relaxed stores are enough.
+	for (size_t i = 0; i < dependencyCounts.size(); ++i)
+	{
+		jobs[i].dependencyCount.store(dependencyCounts[i], std::memory_order_relaxed);
+		jobs[i].dependentsState.store(0, std::memory_order_relaxed);
+		jobs[i].counter = counter;
+		jobs[i].frame = frame;
+	}
+}
+
+Job* const* JobGraph::GetRoots() const
+{
+	return roots.data();
+}
+
+unsigned int JobGraph::GetRootCount() const
+{
+	return static_cast<unsigned int>(roots.size());
+}
+
+unsigned int JobGraph::GetCriticalPathLength() const
+{
+	return criticalPathLength;
+}
+
+unsigned long long JobGraph::GetTotalCost() const
+{
+	return totalCost;
+}
+
+void JobGraph::InvokeFunction(Job* job)
+{
+	(*reinterpret_cast<JobFunction*>(job->payload))();
+}
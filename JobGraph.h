@@ -0,0 +1,58 @@
+#pragma once
+#include <vector>
+#include "JobQueue.h"
+#include "Settings.h"
+
+//JobGraph is a set of jobs and their dependencies that is recorded once and then run as often as needed. Compile
+//validates the graph and lays the jobs out in topological order in one flat array. The jobs themselves are owned by the
+//graph and reused for every run, so running a graph (see JobSystem::Run) does not allocate anything and does not need
+//to wire up any dependencies again, it only resets the dependency counters.
+class JobGraph
+{
+public:
+	JobGraph();
+	~JobGraph();
+	JobGraph(const JobGraph&) = delete;
+	JobGraph& operator=(const JobGraph&) = delete;
+	//Records a job running the given function. cost is the estimated cost in microseconds, which is used by
+	//CRITICAL_PATH_SCHEDULING. Returns the index of the node, which is used to set up dependencies.
+	unsigned int AddNode(JobFunction function, JobPriority priority = JobPriority::Normal, unsigned int cost = 1);
+	//Records that the dependent node has to wait for the dependency node.
+	void AddDependency(unsigned int dependent, unsigned int dependency);
+	//Validates the recorded nodes and builds the jobs. Returns false (and prints why) if a dependency refers to a node
+	//that does not exist or the dependencies form a cycle. Nodes and dependencies can not be added afterwards.
+	bool Compile();
+	bool IsCompiled() const;
+	unsigned int GetNodeCount() const;
+	//Prepares all jobs for the next run by resetting their dependency counters and attaching them to the given counter
+	//(which may be nullptr) and frame (see Job::frame). Must only be called once the previous run is finished.
+	void Reset(JobCounter* counter, signed char frame = -1);
+	//Jobs without any dependencies, which are the ones submitted when the graph is run.
+	Job* const* GetRoots() const;
+	unsigned int GetRootCount() const;
+	//Cost of the longest path through the graph.
+	unsigned int GetCriticalPathLength() const;
+	//Sum of the costs of all nodes.
+	unsigned long long GetTotalCost() const;
+private:
+	struct Node
+	{
+		JobFunction function;
+		JobPriority priority;
+		unsigned int cost;
+	};
+
+	static void InvokeFunction(Job* job);
+
+	//Recorded until the graph is compiled
+	std::vector<Node> nodes;
+	std::vector<std::pair<unsigned int, unsigned int>> dependencies;
+
+	//Jobs in topological order, so every job comes after all of its dependencies.
+	Job* jobs = nullptr;
+	//Dependency count of each job at the start of a run
+	std::vector<unsigned int> dependencyCounts;
+	std::vector<Job*> roots;
+	unsigned int criticalPathLength = 0;
+	unsigned long long totalCost = 0;
+};
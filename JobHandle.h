@@ -0,0 +1,201 @@
+#pragma once
+#include <atomic>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "JobSystem.h"
+#include "Settings.h"
+
+//JobHandle<T> owns a job computing a value of type T. The result is stored next to the callable in the job itself, so
+//there is no allocation besides the job (and for big callables the same one CreateJob does). The job is persistent, so
+//it is kept alive after it finished until the handle is destroyed, which frees it. Handles can only be moved, there is
+//no shared state to count references on. Results are passed on to dependents by moving the handle into them, see Then.
+//The job is added like any other one, AddJob(handle.GetJob(), counter). It must have finished (or never been added)
+//when the handle is destroyed. Handles of jobs allocated from a frame arena have to be destroyed before the frame ends.
+
+//Where the result of a job is stored, next to its callable.
+template<typename T>
+struct JobResult
+{
+	std::optional<T> value;
+};
+
+template<>
+struct JobResult<void>
+{
+};
+
+//Callable of a job with a handle, runs the function and stores its result.
+template<typename T, typename Function>
+struct ResultCallable
+{
+	explicit ResultCallable(Function function) : function(std::move(function)) {}
+
+	void operator()()
+	{
+		if constexpr (std::is_void_v<T>)
+		{
+			function();
+		}
+		else
+		{
+			result.value.emplace(function());
+		}
+	}
+
+	Function function;
+	JobResult<T> result;
+};
+
+template<typename T>
+class JobHandle
+{
+public:
+	JobHandle() {}
+
+	JobHandle(JobSystem& jobsystem, Job* job, JobResult<T>* result) : jobsystem(&jobsystem), job(job), result(result) {}
+
+	JobHandle(JobHandle&& other) noexcept :
+		jobsystem(other.jobsystem), job(std::exchange(other.job, nullptr)), result(std::exchange(other.result, nullptr)) {}
+
+	JobHandle& operator=(JobHandle&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Free();
+			jobsystem = other.jobsystem;
+			job = std::exchange(other.job, nullptr);
+			result = std::exchange(other.result, nullptr);
+		}
+		return *this;
+	}
+
+	JobHandle(const JobHandle&) = delete;
+	JobHandle& operator=(const JobHandle&) = delete;
+
+	~JobHandle()
+	{
+		Free();
+	}
+
+	//The job to add to the system or to set up dependencies with.
+	Job* GetJob() const
+	{
+		return job;
+	}
+
+	//The result is stored before the job finishes, but the job is only done with once Finish released it. Until then
+	//the handle must not free it.
+	bool IsReady() const
+	{
+		return job->dependentsState.load(std::memory_order_acquire) & JOB_DEPENDENTS_RELEASED;
+	}
+
+	//Waits until the job finished, working other jobs in the meantime like WaitForCounter. The job has to be added at
+	//some point, otherwise this only returns once the system stops. Inside a job without FIBER_JOBS the waiting thread
+	//works the job of the handle and the jobs it depends on (up to MAX_COUNTER_DEPENDENCY_DEPTH - 1 levels below it), so
+	//a result can be waited for from inside a job even if no other worker is there to compute it.
+	void Wait()
+	{
+		if (IsReady())
+		{
+			return;
+		}
+		//An empty job depending on ours gives us a counter to wait for, WaitForCounter then works ours as a dependency of
+		//a job of the counter. If ours finished in the meantime, the empty one is worked right away.
+		JobCounter counter;
+		Job* waitJob = jobsystem->CreateJob([]() {}, job->priority);
+		jobsystem->AddLateDependency(waitJob, job);
+		jobsystem->AddJob(waitJob, &counter);
+		jobsystem->WaitForCounter(counter);
+		//The empty job can run as soon as ours released its dependents, which is a moment before Finish is done.
+		WaitUntilReleased();
+	}
+
+	//Waits for the result like Wait and returns it. It stays in the job, so it can be moved out of the reference.
+	decltype(auto) Get()
+	{
+		Wait();
+		if constexpr (!std::is_void_v<T>)
+		{
+			return *result->value;
+		}
+	}
+
+	//Creates a job running function with the result of this one once it finished. The job is passed a T& (nothing if T
+	//is void), so it can move the result into its own. This handle is moved into the new job, which keeps the result
+	//alive until it is freed itself. This job can be added before or after, the new one is added like any other.
+	template<typename Function>
+	auto Then(Function&& function, JobPriority priority = JobPriority::Normal) &&;
+
+private:
+	void Free()
+	{
+		if (job)
+		{
+			//Jobs that never started finishing (as they were never added) can be freed right away.
+			if (job->dependentsState.load(std::memory_order_acquire) & JOB_DEPENDENTS_FINISHED)
+			{
+				WaitUntilReleased();
+			}
+			jobsystem->FreeJob(job);
+			job = nullptr;
+			result = nullptr;
+		}
+	}
+
+	void WaitUntilReleased()
+	{
+		while (!IsReady())
+		{
+			CpuRelax();
+		}
+	}
+
+	//Result of the job, which has already finished if anyone calls this.
+	decltype(auto) GetReadyResult()
+	{
+		if constexpr (!std::is_void_v<T>)
+		{
+			return *result->value;
+		}
+	}
+
+	JobSystem* jobsystem = nullptr;
+	Job* job = nullptr;
+	JobResult<T>* result = nullptr;
+};
+
+//Creates a job running function and returns the handle of the job, which can be used to get the result of function.
+template<typename Function>
+auto CreateJobWithResult(JobSystem& jobsystem, Function&& function, JobPriority priority = JobPriority::Normal)
+{
+	typedef typename std::decay<Function>::type Callable;
+	typedef typename std::decay<std::invoke_result_t<Callable&>>::type T;
+	Job* job = jobsystem.CreateJob(ResultCallable<T, Callable>(Callable(std::forward<Function>(function))), priority);
+	job->persistent = true;
+	return JobHandle<T>(jobsystem, job, &JobSystem::GetCallable<ResultCallable<T, Callable>>(job).result);
+}
+
+template<typename T>
+template<typename Function>
+auto JobHandle<T>::Then(Function&& function, JobPriority priority) &&
+{
+	JobSystem& dependentJobsystem = *jobsystem;
+	Job* dependency = job;
+	//The dependent only runs once the dependency finished, so the result can be read without waiting.
+	auto dependent = CreateJobWithResult(dependentJobsystem,
+		[dependencyHandle = std::move(*this), function = typename std::decay<Function>::type(std::forward<Function>(function))]() mutable
+		{
+			if constexpr (std::is_void_v<T>)
+			{
+				return function();
+			}
+			else
+			{
+				return function(dependencyHandle.GetReadyResult());
+			}
+		}, priority);
+	dependentJobsystem.AddLateDependency(dependent.GetJob(), dependency);
+	return dependent;
+}
@@ -0,0 +1,71 @@
+#include "JobPool.h"
+#include <new>
+
+JobPool::JobPool() : hits(0), misses(0), returnedSlots(nullptr) {}
+
+JobPool::~JobPool()
+{
+	for (Slot* block : blocks)
+	{
+		delete[] block;
+	}
+}
+
+Job* JobPool::Allocate()
+{
+	if (!freeList)
+	{
+		//Take over everything other threads returned in the meantime.
+		freeList = returnedSlots.exchange(nullptr, std::memory_order_acquire);
+	}
+	if (freeList)
+	{
+		hits.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+		misses.fetch_add(1, std::memory_order_relaxed);
+		//Slots are cache line aligned because Job is, so jobs in a block never share a cache line.
+		Slot* block = new Slot[JOB_POOL_BLOCK_SIZE];
+		blocks.push_back(block);
+		for (size_t i = 0; i < JOB_POOL_BLOCK_SIZE; ++i)
+		{
+			block[i].next = freeList;
+			freeList = &block[i];
+		}
+	}
+	Slot* slot = freeList;
+	freeList = slot->next;
+	Job* job = new (slot->storage) Job;
+	job->pool = this;
+	return job;
+}
+
+void JobPool::Free(Job* job)
+{
+	job->~Job();
+	Slot* slot = reinterpret_cast<Slot*>(job);
+	slot->next = freeList;
+	freeList = slot;
+}
+
+void JobPool::Return(Job* job)
+{
+	job->~Job();
+	Slot* slot = reinterpret_cast<Slot*>(job);
+	Slot* head = returnedSlots.load(std::memory_order_relaxed);
+	do
+	{
+		slot->next = head;
+	} while (!returnedSlots.compare_exchange_weak(head, slot, std::memory_order_release, std::memory_order_relaxed));
+}
+
+size_t JobPool::GetHitCount() const
+{
+	return hits.load(std::memory_order_relaxed);
+}
+
+size_t JobPool::GetMissCount() const
+{
+	return misses.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include "JobQueue.h"
+#include "Settings.h"
+
+//JobPool recycles Job objects, so creating and finishing jobs does not touch the heap once the pool is warmed up.
+//Each pool is owned by one thread, which allocates and frees without any synchronization. Jobs finished on another
+//thread are returned through a lock-free stack, which the owner takes over as a whole once its own free list runs dry.
+class JobPool
+{
+public:
+	JobPool();
+	~JobPool();
+	//Constructs a new job. Must only be called by the thread owning the pool.
+	Job* Allocate();
+	//Destroys a job and puts it back onto the free list. Must only be called by the thread owning the pool.
+	void Free(Job* job);
+	//Destroys a job and hands it back to the owning thread. Can be called from any thread.
+	void Return(Job* job);
+	//Number of allocations served without allocating from the heap
+	size_t GetHitCount() const;
+	//Number of allocations that had to allocate a new block of jobs from the heap
+	size_t GetMissCount() const;
+private:
+	//Storage for one job. While the job is not in use the memory is used to link it into a free list.
+	union Slot
+	{
+		Slot* next;
+		alignas(Job) unsigned char storage[sizeof(Job)];
+	};
+
+	//Only touched by the owner.
+	Slot* freeList = nullptr;
+	std::vector<Slot*> blocks;
+	std::atomic<size_t> hits;
+	std::atomic<size_t> misses;
+	//Written by other threads, so it is kept on its own cache line. Jobs are only ever taken out all at once using
+	//exchange, which means the stack does not suffer from the ABA problem.
+	alignas(64) std::atomic<Slot*> returnedSlots;
+};
@@ -1,18 +1,319 @@
 #include "JobQueue.h"
+#include <algorithm>
+#include "EventCount.h"
 #include "Settings.h"
 
-JobQueue::JobQueue(std::atomic<bool>& isRunning) :isRunning(isRunning) {}
+InjectionQueue::InjectionQueue() : size(0) {}
+
+void InjectionQueue::Push(Job* job)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	deques[static_cast<int>(job->priority)].push_back(job);
+	size++;
+}
+
+void InjectionQueue::Push(Job* const* jobs, unsigned int count)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		deques[static_cast<int>(jobs[i]->priority)].push_back(jobs[i]);
+	}
+	size += count;
+}
+
+Job* InjectionQueue::Pop(JobPriority priority)
+{
+	//Avoid taking the lock when there is nothing to take, as every idle worker polls this queue.
+	if (size == 0)
+	{
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> guard(mutex);
+	std::deque<Job*>& deque = deques[static_cast<int>(priority)];
+	if (deque.empty())
+	{
+		return nullptr;
+	}
+	//Injected jobs are worked in the order they were submitted.
+	Job* job = deque.front();
+	deque.pop_front();
+	size--;
+	return job;
+}
+
+Job* InjectionQueue::Pop(const JobCounter* counter)
+{
+	if (size == 0)
+	{
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> guard(mutex);
+	for (std::deque<Job*>& deque : deques)
+	{
+		for (auto it = deque.begin(); it != deque.end(); ++it)
+		{
+			if (IsJobNeededByCounter(*it, counter))
+			{
+				Job* job = *it;
+				deque.erase(it);
+				size--;
+				return job;
+			}
+		}
+	}
+	return nullptr;
+}
+
+bool IsJobNeededByCounter(Job* job, const JobCounter* counter, unsigned int depth)
+{
+	if (job->counter == counter)
+	{
+		return true;
+	}
+	if (depth == MAX_COUNTER_DEPENDENCY_DEPTH)
+	{
+		return false;
+	}
+	//Dependents can still be added late, so they are read under the same lock AddLateDependency takes. Dependents can
+	//not run before the job finished, so their dependents are locked in the same order and can not be gone either.
+	unsigned char state = 0;
+	while (!job->dependentsState.compare_exchange_weak(state, JOB_DEPENDENTS_LOCKED, std::memory_order_acquire, std::memory_order_relaxed))
+	{
+		if (state & JOB_DEPENDENTS_FINISHED)
+		{
+			return false;
+		}
+		state = 0;
+		CpuRelax();
+	}
+	bool isNeeded = false;
+	unsigned int inlineDependentCount = std::min(job->dependentCount, static_cast<unsigned int>(MAX_INLINE_DEPENDENT_COUNT));
+	for (unsigned int i = 0; i < inlineDependentCount && !isNeeded; ++i)
+	{
+		isNeeded = IsJobNeededByCounter(job->dependents[i], counter, depth + 1);
+	}
+	for (DependentChunk* chunk = job->dependentChunks; chunk && !isNeeded; chunk = chunk->next)
+	{
+		for (unsigned int i = 0; i < chunk->count && !isNeeded; ++i)
+		{
+			isNeeded = IsJobNeededByCounter(chunk->dependents[i], counter, depth + 1);
+		}
+	}
+	job->dependentsState.store(0, std::memory_order_release);
+	return isNeeded;
+}
+
+bool InjectionQueue::IsEmpty()
+{
+	return size == 0;
+}
+
+size_t InjectionQueue::GetSize()
+{
+	return size;
+}
+
+JobQueue::JobQueue(std::atomic<bool>& isRunning, InjectionQueue& injectionQueue) :isRunning(isRunning), injectionQueue(injectionQueue) {}
+
+JobQueue::~JobQueue() {}
 
 void JobQueue::Push(Job* job)
+{
+	lanes[static_cast<int>(job->priority)].Push(job);
+}
+
+Job* JobQueue::Pop(JobPriority priority)
+{
+	return lanes[static_cast<int>(priority)].Pop();
+}
+
+size_t JobQueue::StealHalf(JobPriority priority, Job** jobs, size_t maxCount)
+{
+	return lanes[static_cast<int>(priority)].StealHalf(jobs, maxCount);
+}
+
+bool JobQueue::IsEmpty()
+{
+	for (Lane& lane : lanes)
+	{
+		if (!lane.IsEmpty())
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool JobQueue::IsEmpty(JobPriority priority)
+{
+	return lanes[static_cast<int>(priority)].IsEmpty();
+}
+
+size_t JobQueue::GetSize()
+{
+	size_t size = 0;
+	for (Lane& lane : lanes)
+	{
+		size += lane.GetSize();
+	}
+	return size;
+}
+
+#ifdef LOCK_FREE_QUEUE
+//Has to be a power of two, so indices can be wrapped with a mask.
+constexpr int64_t INITIAL_QUEUE_CAPACITY = 64;
+
+JobQueue::Lane::Lane() : top(0), bottom(0), buffer(new RingBuffer(INITIAL_QUEUE_CAPACITY)) {}
+
+JobQueue::Lane::~Lane()
+{
+	delete buffer.load(std::memory_order_relaxed);
+}
+
+//The implementation follows "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al. 2013).
+//The owner works on the bottom (private end) without any atomic read-modify-write, only when the queue is down to its
+//last job it has to race thieves for it using a CAS on top. Thieves always use a CAS on top (public end).
+void JobQueue::Lane::Push(Job* job)
+{
+	int64_t b = bottom.load(std::memory_order_relaxed);
+	int64_t t = top.load(std::memory_order_acquire);
+	RingBuffer* ringBuffer = buffer.load(std::memory_order_relaxed);
+	if (b - t > ringBuffer->Capacity() - 1)
+	{
+		//Queue is full, so grow it. Only the owner pushes, so no one else can be growing at the same time.
+		RingBuffer* grownBuffer = ringBuffer->Grow(b, t);
+		retiredBuffers.emplace_back(ringBuffer);
+		buffer.store(grownBuffer, std::memory_order_release);
+		ringBuffer = grownBuffer;
+	}
+	ringBuffer->Put(b, job);
+	//Make sure the job is written before thieves can see the new bottom
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+Job* JobQueue::Lane::Pop()
+{
+	//Reserve the bottom most job before looking at top, so a thief can not take it at the same time unnoticed.
+	int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+	RingBuffer* ringBuffer = buffer.load(std::memory_order_relaxed);
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = top.load(std::memory_order_relaxed);
+	Job* job = nullptr;
+	if (t <= b)
+	{
+		job = ringBuffer->Get(b);
+		if (t == b)
+		{
+			//This is the last job, so we have to race possible thieves for it.
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				job = nullptr;
+			}
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+	}
+	else
+	{
+		//Queue was empty, restore bottom.
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+	return job;
+}
+
+Job* JobQueue::Lane::Steal()
+{
+	int64_t t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = bottom.load(std::memory_order_acquire);
+	if (t < b)
+	{
+		RingBuffer* ringBuffer = buffer.load(std::memory_order_acquire);
+		Job* job = ringBuffer->Get(t);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			//Lost the race against another thief or the owner taking the last job.
+			return nullptr;
+		}
+		return job;
+	}
+	return nullptr;
+}
+
+size_t JobQueue::Lane::StealHalf(Job** jobs, size_t maxCount)
+{
+	int64_t t = top.load(std::memory_order_acquire);
+	int64_t b = bottom.load(std::memory_order_acquire);
+	int64_t half = (b - t + 1) / 2;
+	size_t count = half > 0 ? std::min(static_cast<size_t>(half), maxCount) : 1;
+	//The owner pops everything but the last job without touching top, so advancing top by more than one at once could
+	//take jobs the owner already popped. Every job therefore needs its own CAS, but the thief does not have to go through
+	//victim selection and its own queue again for each of them.
+	size_t stolen = 0;
+	while (stolen < count)
+	{
+		Job* job = Steal();
+		if (!job)
+		{
+			break;
+		}
+		jobs[stolen++] = job;
+	}
+	return stolen;
+}
+
+bool JobQueue::Lane::IsEmpty() {
+	return bottom.load(std::memory_order_acquire) <= top.load(std::memory_order_acquire);
+}
+
+size_t JobQueue::Lane::GetSize()
+{
+	//The owner temporarily moves bottom below top while popping the last job.
+	int64_t size = bottom.load(std::memory_order_acquire) - top.load(std::memory_order_acquire);
+	return size > 0 ? static_cast<size_t>(size) : 0;
+}
+
+JobQueue::Lane::RingBuffer::RingBuffer(int64_t capacity) : mask(capacity - 1), slots(new std::atomic<Job*>[capacity]) {}
+
+int64_t JobQueue::Lane::RingBuffer::Capacity() const
+{
+	return mask + 1;
+}
+
+Job* JobQueue::Lane::RingBuffer::Get(int64_t index) const
+{
+	return slots[index & mask].load(std::memory_order_relaxed);
+}
+
+void JobQueue::Lane::RingBuffer::Put(int64_t index, Job* job)
+{
+	slots[index & mask].store(job, std::memory_order_relaxed);
+}
+
+JobQueue::Lane::RingBuffer* JobQueue::Lane::RingBuffer::Grow(int64_t bottom, int64_t top) const
+{
+	RingBuffer* grownBuffer = new RingBuffer(Capacity() * 2);
+	for (int64_t i = top; i < bottom; ++i)
+	{
+		grownBuffer->Put(i, Get(i));
+	}
+	return grownBuffer;
+}
+#else
+JobQueue::Lane::Lane() {}
+
+JobQueue::Lane::~Lane() {}
+
+void JobQueue::Lane::Push(Job* job)
 {
 	std::lock_guard<std::mutex> guard(mutex);
 	//back of deque is defined as private end
 	deque.push_back(job);
-	//notify as a job is available
-	NotifyOne();
 }
 
-Job* JobQueue::Pop()
+Job* JobQueue::Lane::Pop()
 {
 	std::lock_guard<std::mutex> guard(mutex);
 	if (deque.empty())
@@ -25,7 +326,7 @@ Job* JobQueue::Pop()
 	return job;
 }
 
-Job* JobQueue::Steal()
+Job* JobQueue::Lane::Steal()
 {
 	std::lock_guard<std::mutex> guard(mutex);
 	if (deque.empty())
@@ -39,20 +340,54 @@ Job* JobQueue::Steal()
 	return job;
 }
 
-bool JobQueue::IsEmpty() {
+size_t JobQueue::Lane::StealHalf(Job** jobs, size_t maxCount)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	//Take half of the jobs rounded up, so a single job can be stolen as well.
+	size_t count = std::min((deque.size() + 1) / 2, maxCount);
+	for (size_t i = 0; i < count; ++i)
+	{
+		jobs[i] = deque.front();
+		deque.pop_front();
+	}
+	return count;
+}
+
+bool JobQueue::Lane::IsEmpty() {
 	std::lock_guard<std::mutex> guard(mutex);
 	return deque.empty();
 }
 
+size_t JobQueue::Lane::GetSize()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return deque.size();
+}
+#endif
+
 void JobQueue::WaitForJob() {
 	std::unique_lock<std::mutex> lock(conditionalVaribleMutex);
-	//Wait until jobs are available or the system stopped runnning.
+	sleeping = true;
+	//Wait until jobs are available, someone explicitly woke us or the system stopped runnning. Everyone changing any of
+	//these conditions takes conditionalVaribleMutex before notifying, so the change either happened before we check the
+	//predicate or the notification reaches us after we started waiting. The queues themselves are only read through
+	//their own synchronization.
 	conditionalVariable.wait(lock, [&]()
 		{
-			return (!isRunning || !deque.empty());
+			return (wakeUpPending || !isRunning || !IsEmpty() || !injectionQueue.IsEmpty());
 		});
+	sleeping = false;
+	wakeUpPending = false;
 }
 
-void JobQueue::NotifyOne() {
+bool JobQueue::NotifyOne() {
+	std::lock_guard<std::mutex> lock(conditionalVaribleMutex);
+	//A worker already woken does not need another notification, so the caller can try to wake someone else instead.
+	if (!sleeping || wakeUpPending)
+	{
+		return false;
+	}
+	wakeUpPending = true;
 	conditionalVariable.notify_one();
+	return true;
 }
@@ -1,63 +1,260 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <vector>
 #include "Settings.h"
 
-#define MAX_DEPENDENT_COUNT 13
+//How many dependents are stored inline in a job. Any further dependents spill into DependentChunks.
+#define MAX_INLINE_DEPENDENT_COUNT 12
+//How many dependents fit into one DependentChunk.
+#define DEPENDENT_CHUNK_SIZE 14
+//Bytes available in a job to store its callable (function pointer, lambda captures, ...) without extra allocation.
+#define JOB_PAYLOAD_SIZE 88
+#define JOB_PAYLOAD_ALIGNMENT 8
+//Flags of Job::dependentsState
+#define JOB_DEPENDENTS_LOCKED 1
+#define JOB_DEPENDENTS_FINISHED 2
+//Set once Finish is done with a persistent job, its owner may free or reuse it from then on.
+#define JOB_DEPENDENTS_RELEASED 4
+//Flag of JobCounter::value, set while jobs or fibers are waiting in the lists of the counter.
+#define COUNTER_HAS_WAITERS 0x80000000u
+//How many levels of dependents IsJobNeededByCounter looks through.
+#define MAX_COUNTER_DEPENDENCY_DEPTH 4
 typedef void (*JobFunction)();
 
 struct Job;
+struct JobCounter;
+struct JobFiber;
+typedef void (*JobInvokeFunction)(Job*);
+class JobPool;
 
-//JobQueue manages thread save access to a queue using a mutex.
+//Priority of a job. Workers always work (and steal) jobs of the highest priority available first, see
+//PRIORITY_STARVATION_LIMIT in Settings.h for how lower priorities still get their turn.
+enum class JobPriority : unsigned char
+{
+	High = 0,
+	Normal = 1,
+	Low = 2,
+};
+#define JOB_PRIORITY_COUNT 3
+
+//InjectionQueue takes jobs submitted from threads that are not workers (like the main runner) and therefore do not own
+//a JobQueue. Any thread may push and every worker may pop, so it is a simple FIFO per priority guarded by a mutex.
+class InjectionQueue
+{
+public:
+	InjectionQueue();
+	void Push(Job* job);
+	//Pushes all given jobs while taking the lock only once.
+	void Push(Job* const* jobs, unsigned int count);
+	//Pop the oldest job of the given priority
+	Job* Pop(JobPriority priority);
+	//Pop the oldest job needed by the counter (see IsJobNeededByCounter), starting with the highest priority
+	Job* Pop(const JobCounter* counter);
+	bool IsEmpty();
+	//Number of queued jobs of all priorities
+	size_t GetSize();
+private:
+	std::deque<Job*> deques[JOB_PRIORITY_COUNT];
+	//Mirrors the size of all deques together, so workers can check for work without taking the lock.
+	std::atomic<size_t> size;
+	std::mutex mutex;
+};
+
+//JobQueue manages thread save access to the jobs of one worker. It has one lane per priority, each lane is either a
+//lock-free Chase-Lev work-stealing deque or a std::deque guarded by a mutex, depending on LOCK_FREE_QUEUE (see Settings.h).
 class JobQueue
 {
 public:
-	JobQueue(std::atomic<bool>& isRunning);
-	//Push job onto public end of the queue
+	JobQueue(std::atomic<bool>& isRunning, InjectionQueue& injectionQueue);
+	~JobQueue();
+	//Push job onto the private end of the lane of its priority. Must only be called by the thread owning the queue.
 	void Push(Job* job);
-	//Pop a job from the private end of the queue
-	Job* Pop();
-	//Pop a job from the public end of the queue
-	Job* Steal();
+	//Pop a job from the private end of the given lane. Must only be called by the thread owning the queue.
+	Job* Pop(JobPriority priority);
+	//Pop up to half of the jobs (but at least one and at most maxCount) from the public end of the given lane. The jobs
+	//are written to the given array oldest first. Returns how many jobs were taken.
+	size_t StealHalf(JobPriority priority, Job** jobs, size_t maxCount);
+	//Checks if all lanes are empty
 	bool IsEmpty();
-	//Wait until the queue is not empty anymore
+	bool IsEmpty(JobPriority priority);
+	//Number of jobs in all lanes. Only a snapshot, as thieves and the owner keep changing it.
+	size_t GetSize();
+	//Wait until the queue or the injection queue is not empty anymore or NotifyOne was called. Must only be called by
+	//the thread owning the queue. Only used if PARK_ON_EVENT_COUNT is undefined.
 	void WaitForJob();
-	//Notify someone waiting on the queue to not be empty anymore
-	void NotifyOne();
+	//Wake the worker sleeping in WaitForJob, so it can look for work elsewhere. Returns false if it was not sleeping or
+	//has already been woken. Only used if PARK_ON_EVENT_COUNT is undefined.
+	bool NotifyOne();
 private:
-	std::deque<Job*> deque;
-	std::mutex mutex;
+	//Queue of the jobs of one priority.
+	class Lane
+	{
+	public:
+		Lane();
+		~Lane();
+		//Push job onto the private end of the lane. Must only be called by the thread owning the queue.
+		void Push(Job* job);
+		//Pop a job from the private end of the lane. Must only be called by the thread owning the queue.
+		Job* Pop();
+		//Pop a job from the public end of the lane
+		Job* Steal();
+		size_t StealHalf(Job** jobs, size_t maxCount);
+		bool IsEmpty();
+		size_t GetSize();
+	private:
+#ifdef LOCK_FREE_QUEUE
+		//Power of two sized circular array the deque is stored in. Indices grow monotonically and are wrapped using the mask.
+		struct RingBuffer
+		{
+			RingBuffer(int64_t capacity);
+			int64_t Capacity() const;
+			Job* Get(int64_t index) const;
+			void Put(int64_t index, Job* job);
+			//Creates a buffer of twice the size containing all elements between top and bottom
+			RingBuffer* Grow(int64_t bottom, int64_t top) const;
+
+			int64_t mask;
+			std::unique_ptr<std::atomic<Job*>[]> slots;
+		};
+
+		//top and bottom are written by different threads, so they are kept on separate cache lines to avoid false sharing.
+		//Public end, advanced by thieves (and the owner when taking the very last job).
+		alignas(64) std::atomic<int64_t> top;
+		//Private end, only written by the owner.
+		alignas(64) std::atomic<int64_t> bottom;
+		alignas(64) std::atomic<RingBuffer*> buffer;
+		//Buffers replaced by Grow can still be read by a thief that loaded the old pointer, so they are kept alive
+		//until the queue is destroyed. As the buffer doubles each time this wastes at most as much memory as is in use.
+		std::vector<std::unique_ptr<RingBuffer>> retiredBuffers;
+#else
+		std::deque<Job*> deque;
+		std::mutex mutex;
+#endif
+	};
+
+	Lane lanes[JOB_PRIORITY_COUNT];
 	std::atomic<bool>& isRunning;
+	//Shared queue of jobs submitted from outside of the workers. Sleeping workers need to wake up for those as well.
+	InjectionQueue& injectionQueue;
 	std::mutex conditionalVaribleMutex;
 	std::condition_variable conditionalVariable;
+	//Both guarded by conditionalVaribleMutex
+	bool sleeping = false;
+	bool wakeUpPending = false;
+};
+
+//Job to be added once a counter reaches zero, see JobSystem::AddJobAfterCounter. Owned by whoever waits, it has to stay
+//valid until the job is added.
+struct CounterWaiter
+{
+	Job* job = nullptr;
+	//Next waiter of the same counter
+	CounterWaiter* next = nullptr;
+};
+
+//JobCounter counts the unfinished jobs of a group, like all jobs of a frame. Jobs are attached to a counter when they are
+//added (see JobSystem::AddJob) and JobSystem::WaitForCounter waits until all of them are finished, independent of any
+//other work in the system. Counters are kept on their own cache line, as all workers finishing jobs of the group write it.
+struct alignas(64) JobCounter
+{
+	//Number of attached jobs that are not finished yet, plus COUNTER_HAS_WAITERS while anyone is in the lists below.
+	//Finishing jobs only take the lock if the flag is set.
+	std::atomic<unsigned int> value = 0;
+	//Fibers suspended until the counter reaches zero, only used with FIBER_JOBS. Guarded by locked.
+	JobFiber* waitingFibers = nullptr;
+	//Jobs to be added once the counter reaches zero. Guarded by locked.
+	CounterWaiter* waiters = nullptr;
+	std::atomic<bool> locked = false;
 };
 
-struct Job
+//Continuation chunk for the dependents of a job that did not fit inline anymore. The chunks of a job form an intrusive
+//singly linked list, so a job can have any number of dependents without growing in size.
+struct alignas(64) DependentChunk
 {
-	JobFunction jobFunction = nullptr; // 8 Bytes (assumed not guaranteed)
-	//Pointer to the queue the job is stored in. Used to notify when job becomes workable.
-	JobQueue* queue = nullptr; //8 bytes
-	// Number of current dependencies to other jobs (which this job has to wait for)
-	std::atomic<unsigned int> dependencyCount = 0; //should be 4 Bytes (but not guaranteed)
+	Job* dependents[DEPENDENT_CHUNK_SIZE] = {}; //8 Bytes * 14 = 112 bytes
+	DependentChunk* next = nullptr; //8 bytes
+	// Number of dependents stored in this chunk
+	unsigned int count = 0; //4 bytes
+	//Chunks are taken from the frame arena when possible, only chunks allocated on the heap have to be deleted.
+	bool heapAllocated = false; //1 byte
+	//Sum bytes = 112+8+4+1=125bytes, which gets padded to two full cache lines by the alignment.
+};
+
+//Jobs are aligned to cache lines, so a job never shares a line with another one. The first cache line holds everything
+//the scheduler touches, the dependents and the payload follow in the remaining three.
+struct alignas(64) Job
+{
+	//Entry point of the job, calls the callable stored in the payload.
+	JobInvokeFunction invoke = nullptr; //8 bytes
+	//Destroys the callable stored in the payload. nullptr if it is trivially destructible.
+	JobInvokeFunction destroy = nullptr; //8 bytes
+	// Number of current dependencies to other jobs (which this job has to wait for). Starts at one, which stands for the
+	// job not being added to the system yet. Whoever brings this down to zero pushes the job into a queue.
+	std::atomic<unsigned int> dependencyCount = 1; //should be 4 Bytes (but not guaranteed)
 	// Number of dependents of this job
 	unsigned int dependentCount = 0; //4 bytes
+	//Pool the job was allocated from and has to be returned to when finished. nullptr for jobs owned by a frame arena.
+	JobPool* pool = nullptr; //8 bytes
+	//Decides which lane of a queue the job is pushed to.
+	JobPriority priority = JobPriority::Normal; //1 byte
+	//Persistent jobs are owned by a JobGraph, which reuses them, or by a JobHandle, which keeps their result. Finishing
+	//them does not destroy them.
+	bool persistent = false; //1 byte
+	//Combination of the JOB_DEPENDENTS_ flags, guards adding dependents after the job was added (see
+	//JobSystem::AddLateDependency) against the job finishing at the same time.
+	std::atomic<unsigned char> dependentsState = 0; //1 byte
+	//Index of the worker group (one per NUMA node) the job should run on, -1 if it has no locality hint.
+	signed char localityGroup = -1; //1 byte
+	//Index of the frame arena of the frame the job was added in, -1 outside of frames. Only set with
+	//CRITICAL_PATH_SCHEDULING, the path priority of the job is relative to the critical path of that frame.
+	signed char frame = -1; //1 byte
+	//Estimated cost of the job in microseconds. Jobs without an estimate count as taking 1us.
+	unsigned int cost = 1; //4 bytes
+	//Cost of the longest path from this job to the end of its graph (including its own cost). 0 until it is computed.
+	unsigned int pathLength = 0; //4 bytes
+	//Key the measured duration of the job is learned under, nullptr if it is not learned.
+	const void* costKey = nullptr; //8 bytes
+	//Counter of the group the job belongs to, decremented when the job is finished. nullptr if nobody waits for it.
+	JobCounter* counter = nullptr; //8 bytes
 	// Jobs that depend on this job
-	Job* dependents[MAX_DEPENDENT_COUNT] = {}; //8 Bytes * 13 = 104 bytes
-	//Sum bytes = 8+8+4+4+(8*13)=128bytes, which should be two full cache lines.
+	alignas(64) Job* dependents[MAX_INLINE_DEPENDENT_COUNT] = {}; //8 Bytes * 12 = 96 bytes
+	//Dependents beyond MAX_INLINE_DEPENDENT_COUNT, the chunk added last comes first.
+	DependentChunk* dependentChunks = nullptr; //8 bytes
+	//Callable of the job. Stored inline if it fits, otherwise it holds a pointer to the callable stored elsewhere.
+	alignas(JOB_PAYLOAD_ALIGNMENT) unsigned char payload[JOB_PAYLOAD_SIZE]; //88 bytes
+	//Sum bytes = 64+(8*12)+8+88=256bytes, which should be four full cache lines.
 
 	~Job() {
-		for (unsigned int i = 0; i < dependentCount; ++i)
+		Release();
+	}
+
+	//Destroys the callable and frees the dependent chunks, but leaves the job itself intact.
+	void Release() {
+		if (destroy)
+		{
+			destroy(this);
+			destroy = nullptr;
+		}
+		DependentChunk* chunk = dependentChunks;
+		while (chunk)
 		{
-			//Job is finished, so depentens can reduce dependencyCount
-			dependents[i]->dependencyCount--;
-			if (dependents[i]->dependencyCount == 0) {
-				//This check is necessary because depencies could be finished before dependents even get added to any queue
-				if (dependents[i]->queue) {
-					//If dependent is workable notify the queue
-					dependents[i]->queue->NotifyOne();
-				}
+			DependentChunk* next = chunk->next;
+			if (chunk->heapAllocated)
+			{
+				delete chunk;
 			}
+			chunk = next;
 		}
+		dependentChunks = nullptr;
 	}
 };
+static_assert(sizeof(Job) == 256, "Job should span exactly four cache lines.");
 
+//Checks if the job is attached to the counter or if a job attached to it waits for this one, directly or over up to
+//MAX_COUNTER_DEPENDENCY_DEPTH other dependents. The job must not be running yet.
+bool IsJobNeededByCounter(Job* job, const JobCounter* counter, unsigned int depth = 0);
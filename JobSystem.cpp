@@ -1,12 +1,17 @@
 #include "JobSystem.h"
+#include <new>
 #include <stdlib.h>
 #include <algorithm>
+#include <chrono>
 #include <mutex>
 #include <string>
 #include "optick_src/optick.h"
 #include "Settings.h"
 
 int JobSystem::thread_id = -1;
+FrameArena* JobSystem::current_arena = nullptr;
+Job* JobSystem::current_job = nullptr;
+JobFiber* JobSystem::current_fiber = nullptr;
 
 JobSystem::JobSystem(std::atomic<bool>& isRunning, int desiredThreadCount) : isRunning(isRunning)
 {
@@ -63,72 +68,892 @@ JobSystem::JobSystem(std::atomic<bool>& isRunning, int desiredThreadCount) : isR
 			thread_count = threadCount;
 		}
 	}
-	//spawn a worker and a queue for each thread
+#ifdef ELASTIC_WORKERS
+	//Every hardware thread gets a worker, but only the number picked above starts out active, see AdaptWorkerCount.
+	activeWorkerCount = thread_count;
+	thread_count = available_threads;
+	idleTimes.reset(new WorkerIdleTime[thread_count]);
+#else
+	activeWorkerCount = thread_count;
+#endif
+	//create a queue and a job pool for each thread. This is done before spawning any worker, so the vectors do not get
+	//reallocated while workers already access them.
+	for (unsigned int core = 0; core < thread_count; ++core)
+	{
+#ifdef NUMA_AWARE
+		//Allocated by the workers themselves, see AllocateWorkerData.
+		queues.push_back(nullptr);
+		pools.push_back(nullptr);
+#else
+		queues.push_back(new JobQueue(isRunning, injectionQueue));
+		pools.push_back(new JobPool());
+#endif
+		WorkerState* workerState = new WorkerState();
+		//xorshift must not start at zero, otherwise it only ever produces zeros.
+		workerState->randomState = 2463534242u + core * 0x9E3779B9u;
+		workerStates.push_back(workerState);
+	}
+	for (unsigned int i = 0; i < FRAME_ARENA_COUNT; ++i)
+	{
+		frameArenas.push_back(new FrameArena(FRAME_ARENA_SIZE));
+	}
+	criticalPaths = std::vector<CriticalPath>(FRAME_ARENA_COUNT + 1);
+#ifdef PIN_WORKERS
+	PickWorkerCpus();
+#endif
+#ifdef FIBER_JOBS
+	for (unsigned int i = 0; i < FIBER_POOL_SIZE; ++i)
+	{
+		JobFiber* fiber = CreateFiber();
+		fiber->next = freeFibers;
+		freeFibers = fiber;
+	}
+#endif
+	//spawn a worker for each thread
 	for (unsigned int core = 0; core < thread_count; ++core)
 	{
 		PRINT(("CREATING WORKER FOR CORE " + std::to_string(core) + "\n").c_str());
-		JobQueue* queue = new JobQueue(isRunning);
-		queues.push_back(queue);
 		workers.push_back(std::thread(&JobSystem::Worker, this, core));
 	}
+#ifdef NUMA_AWARE
+	//Jobs can only be pushed once every worker has its queue.
+	std::unique_lock<std::mutex> lock(startMutex);
+	startCondition.wait(lock, [&]() { return startedWorkers == workers.size(); });
+#endif
+}
+
+JobSystem::~JobSystem()
+{
+	for (JobQueue* queue : queues)
+	{
+		delete queue;
+	}
+	for (JobPool* pool : pools)
+	{
+		delete pool;
+	}
+	for (WorkerState* workerState : workerStates)
+	{
+		delete workerState;
+	}
+	for (FrameArena* arena : frameArenas)
+	{
+		delete arena;
+	}
+	for (WorkerGroup* group : workerGroups)
+	{
+		delete group;
+	}
+	//Fibers still suspended when the system stopped are never resumed, their stacks are simply released.
+	for (JobFiber* fiber : fibers)
+	{
+		delete fiber->fiber;
+		delete fiber;
+	}
+}
+
+void JobSystem::JoinJobs()
+{
+	//stop the jobsystem
+	isRunning = false;
+	//stop potentially picking up new jobs
+	stopped = true;
+	//wake up all threads
+	WakeAll();
+	//wait for each thread to join
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	size_t poolHits = externalPool.GetHitCount();
+	size_t poolMisses = externalPool.GetMissCount();
+	for (JobPool* pool : pools)
+	{
+		poolHits += pool->GetHitCount();
+		poolMisses += pool->GetMissCount();
+	}
+	PRINT_ESSENTIAL(("Job pool hits: " + std::to_string(poolHits) + ", misses: " + std::to_string(poolMisses) + "\n").c_str());
+	PRINT_ESSENTIAL(("Frame arena overflows: " + std::to_string(arenaOverflows) + "\n").c_str());
+	for (size_t i = 0; i < workerStates.size(); ++i)
+	{
+		//Shows how well the load was balanced between the workers.
+		WorkerState* workerState = workerStates[i];
+		PRINT_ESSENTIAL(("Worker #" + std::to_string(i) + " executed " + std::to_string(workerState->executedJobs) + " jobs, steals: " +
+			std::to_string(workerState->successfulSteals) + " successful (" + std::to_string(workerState->stolenJobs) + " jobs), " +
+			std::to_string(workerState->failedSteals) + " failed.\n").c_str());
+	}
+#ifdef FIBER_JOBS
+	PRINT_ESSENTIAL(("Fibers created: " + std::to_string(fibers.size()) + "\n").c_str());
+#endif
+#ifdef ELASTIC_WORKERS
+	PRINT_ESSENTIAL(("Elastic workers: " + std::to_string(activeWorkerCount) + " of " + std::to_string(workers.size()) +
+		" active at the end, changed " + std::to_string(elasticState.changes) + " times.\n").c_str());
+#endif
+}
+
+#ifdef PIN_WORKERS
+void JobSystem::PickWorkerCpus()
+{
+	CpuTopology topology;
+	std::vector<CpuInfo> cpus = topology.PickWorkerCpus(static_cast<unsigned int>(workerStates.size()));
+	for (size_t i = 0; i < workerStates.size(); ++i)
+	{
+		workerStates[i]->cpu = cpus[i];
+		PRINT(("Worker #" + std::to_string(i) + " runs on CPU " + std::to_string(cpus[i].id) + "\n").c_str());
+	}
+	for (size_t i = 0; i < workerStates.size(); ++i)
+	{
+		WorkerState* workerState = workerStates[i];
+		for (size_t victim = 0; victim < workerStates.size(); ++victim)
+		{
+			if (victim != i)
+			{
+				workerState->victims.push_back(static_cast<int>(victim));
+			}
+		}
+		auto distance = [&](int victim) { return topology.GetDistance(workerState->cpu, workerStates[victim]->cpu); };
+		std::stable_sort(workerState->victims.begin(), workerState->victims.end(), [&](int a, int b) { return distance(a) < distance(b); });
+		for (size_t j = 1; j <= workerState->victims.size(); ++j)
+		{
+			if (j == workerState->victims.size() || distance(workerState->victims[j]) != distance(workerState->victims[j - 1]))
+			{
+				workerState->victimGroupEnds.push_back(j);
+			}
+		}
+	}
+#ifdef NUMA_AWARE
+	for (size_t i = 0; i < workerStates.size(); ++i)
+	{
+		int node = workerStates[i]->cpu.numaNode;
+		size_t group = 0;
+		while (group < workerGroups.size() && workerGroups[group]->numaNode != node)
+		{
+			group++;
+		}
+		if (group == workerGroups.size())
+		{
+			workerGroups.push_back(new WorkerGroup(node));
+		}
+		workerGroups[group]->workers.push_back(static_cast<int>(i));
+		workerStates[i]->group = static_cast<int>(group);
+	}
+	for (WorkerGroup* group : workerGroups)
+	{
+		PRINT_ESSENTIAL(("NUMA node " + std::to_string(group->numaNode) + " has " + std::to_string(group->workers.size()) + " workers.\n").c_str());
+	}
+#endif
+}
+#endif
+
+#ifdef NUMA_AWARE
+void JobSystem::AllocateWorkerData(unsigned int id)
+{
+	//Memory is placed on the node of the thread touching it first, which is us now that we are pinned. Jobs allocated
+	//from the pool later on are touched by us first as well.
+	queues[id] = new JobQueue(isRunning, injectionQueue);
+	pools[id] = new JobPool();
+	WorkerState* workerState = new WorkerState(*workerStates[id]);
+	delete workerStates[id];
+	workerStates[id] = workerState;
+	//Others must not steal from us before our queue exists and we must not steal from them before theirs does.
+	std::unique_lock<std::mutex> lock(startMutex);
+	startedWorkers++;
+	startCondition.notify_all();
+	startCondition.wait(lock, [&]() { return startedWorkers == queues.size(); });
+}
+
+bool JobSystem::PushToLocalityGroup(Job* job)
+{
+	int group = job->localityGroup;
+	if (group < 0 || (thread_id >= 0 && workerStates[thread_id]->group == group))
+	{
+		return false;
+	}
+	workerGroups[group]->injectionQueue.Push(job);
+	return true;
+}
+
+Job* JobSystem::StealFromOtherGroups(JobPriority priority)
+{
+	int ownGroup = workerStates[thread_id]->group;
+	for (size_t group = 0; group < workerGroups.size(); ++group)
+	{
+		if (static_cast<int>(group) == ownGroup)
+		{
+			continue;
+		}
+		Job* job = workerGroups[group]->injectionQueue.Pop(priority);
+		if (job)
+		{
+			WorkerState* workerState = workerStates[thread_id];
+			workerState->successfulSteals++;
+			workerState->stolenJobs++;
+			return job;
+		}
+	}
+	return nullptr;
+}
+#endif
+
+void JobSystem::SetLocality([[maybe_unused]] Job* job, [[maybe_unused]] int numaNode)
+{
+#ifdef NUMA_AWARE
+	for (size_t group = 0; group < workerGroups.size(); ++group)
+	{
+		if (numaNode >= 0 && workerGroups[group]->numaNode == numaNode)
+		{
+			job->localityGroup = static_cast<signed char>(group);
+			return;
+		}
+	}
+#endif
+}
+
+void JobSystem::SetLocality([[maybe_unused]] Job* job, [[maybe_unused]] const void* data)
+{
+#ifdef NUMA_AWARE
+	SetLocality(job, CpuTopology::GetMemoryNode(data));
+#endif
+}
+
+unsigned int JobSystem::GetWorkerCount()
+{
+	return activeWorkerCount.load(std::memory_order_relaxed);
+}
+
+#ifdef ELASTIC_WORKERS
+bool JobSystem::ParkIfInactive(unsigned int id)
+{
+	if (id < activeWorkerCount || !GetQueue()->IsEmpty())
+	{
+		return false;
+	}
+	//We might have been woken for work that was meant for an active worker, so pass it on.
+	if (HasAvailableWork())
+	{
+		NotifyWorker();
+	}
+	uint32_t key = parkedWorkers.PrepareWait();
+	if (id < activeWorkerCount || !isRunning)
+	{
+		parkedWorkers.CancelWait();
+		return true;
+	}
+	parkedWorkers.Wait(key);
+	return true;
+}
+
+void JobSystem::AdaptWorkerCount()
+{
+	//Frames can end on several threads at once, one of them deciding is enough.
+	std::unique_lock<std::mutex> lock(elasticMutex, std::try_to_lock);
+	if (!lock.owns_lock() || ++elasticState.endedFrames < ELASTIC_WORKERS_INTERVAL)
+	{
+		return;
+	}
+	auto now = std::chrono::steady_clock::now();
+	long long intervalTime = std::max(1LL, static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - elasticState.intervalStart).count()));
+	long long frameTime = intervalTime / elasticState.endedFrames / 1000;
+	unsigned long long idleNanoseconds = 0;
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		idleNanoseconds += idleTimes[i].nanoseconds.load(std::memory_order_relaxed);
+	}
+	unsigned int activeCount = activeWorkerCount;
+	//Workers parked during the interval were idle before, so this can exceed 100%.
+	unsigned long long idlePercent = std::min(100ULL, (idleNanoseconds - elasticState.idleNanoseconds) * 100 / (activeCount * static_cast<unsigned long long>(intervalTime)));
+	unsigned long long depthSamples = queueDepthSamples.exchange(0, std::memory_order_relaxed);
+	unsigned long long depthSum = queueDepthSum.exchange(0, std::memory_order_relaxed);
+	double queueDepth = depthSamples > 0 ? static_cast<double>(depthSum) / depthSamples : 0.0;
+
+	unsigned int newActiveCount = activeCount;
+	if (elasticState.grew && frameTime * 100 > elasticState.frameTime * (100 - ELASTIC_WORKERS_MIN_GAIN_PERCENT))
+	{
+		//The worker activated last time did not make the frames faster, so it only costs.
+		newActiveCount--;
+		elasticState.growHold = ELASTIC_WORKERS_HOLD_INTERVALS;
+	}
+	else if (idlePercent > ELASTIC_WORKERS_SHRINK_IDLE_PERCENT && activeCount > 1)
+	{
+		newActiveCount--;
+	}
+	else if (elasticState.growHold == 0 && queueDepth >= activeCount * ELASTIC_WORKERS_GROW_QUEUE_DEPTH && activeCount < workers.size())
+	{
+		newActiveCount++;
+	}
+	else if (elasticState.growHold > 0)
+	{
+		elasticState.growHold--;
+	}
+
+	if (newActiveCount != activeCount)
+	{
+		activeWorkerCount = newActiveCount;
+		if (newActiveCount > activeCount)
+		{
+			parkedWorkers.NotifyAll();
+		}
+		else
+		{
+			//The parked worker could be waiting for work, it has to wake up to notice it should park instead.
+			idleWorkers.NotifyAll();
+			queues[newActiveCount]->NotifyOne();
+		}
+		elasticState.changes++;
+		PRINT_ESSENTIAL(("Elastic workers: " + std::to_string(activeCount) + " -> " + std::to_string(newActiveCount) + " of " +
+			std::to_string(workers.size()) + " active (queue depth " + std::to_string(static_cast<unsigned long long>(queueDepth + 0.5)) + ", " + std::to_string(idlePercent) +
+			" percent idle, frame time " + std::to_string(frameTime) + "us).\n").c_str());
+	}
+	elasticState.grew = newActiveCount > activeCount;
+	elasticState.frameTime = frameTime;
+	elasticState.idleNanoseconds = idleNanoseconds;
+	elasticState.endedFrames = 0;
+	elasticState.intervalStart = now;
+}
+
+void JobSystem::SampleQueueDepth()
+{
+	if (thread_id >= 0)
+	{
+		unsigned int& pushesSinceSample = workerStates[thread_id]->pushesSinceSample;
+		if (++pushesSinceSample < ELASTIC_WORKERS_DEPTH_SAMPLE_INTERVAL)
+		{
+			return;
+		}
+		pushesSinceSample = 0;
+	}
+	size_t depth = injectionQueue.GetSize();
+	for (JobQueue* queue : queues)
+	{
+		depth += queue->GetSize();
+	}
+	queueDepthSum.fetch_add(depth, std::memory_order_relaxed);
+	queueDepthSamples.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+Job* JobSystem::AllocateJob()
+{
+	if (current_arena)
+	{
+		//Jobs of a frame all die together, so they are simply bumped out of the frame arena. Their pool stays nullptr.
+		void* memory = current_arena->Allocate(sizeof(Job), alignof(Job));
+		if (memory)
+		{
+			return new (memory) Job;
+		}
+	}
+	JobPool* pool = GetPool();
+	if (pool)
+	{
+		return pool->Allocate();
+	}
+	std::lock_guard<std::mutex> guard(externalPoolMutex);
+	return externalPool.Allocate();
+}
+
+void JobSystem::AddDependency(Job* dependent, Job* dependency)
+{
+	AppendDependent(dependency, dependent);
+	// Increase dependency count, blocking this job until all dependencies are resolved
+	dependent->dependencyCount++;
+}
+
+bool JobSystem::AddLateDependency(Job* dependent, Job* dependency)
+{
+	//Finish takes the same lock to mark the job finished before reading its dependents, so the dependent is either
+	//appended in time or we see the job finished.
+	//Seeing the job finished has to acquire as well, the dependent will then run right away and read what it wrote.
+	unsigned char state = 0;
+	while (!dependency->dependentsState.compare_exchange_weak(state, JOB_DEPENDENTS_LOCKED, std::memory_order_acquire, std::memory_order_acquire))
+	{
+		if (state & JOB_DEPENDENTS_FINISHED)
+		{
+			return false;
+		}
+		state = 0;
+		CpuRelax();
+	}
+	AppendDependent(dependency, dependent);
+	dependent->dependencyCount++;
+	dependency->dependentsState.store(0, std::memory_order_release);
+	return true;
+}
+
+void JobSystem::AppendDependent(Job* dependency, Job* dependent)
+{
+	// Add dependent to the job.
+	if (dependency->dependentCount < MAX_INLINE_DEPENDENT_COUNT)
+	{
+		//Common case, which does not need any allocation.
+		dependency->dependents[dependency->dependentCount] = dependent;
+	}
+	else
+	{
+		//The inline dependents are full, so spill into a continuation chunk.
+		DependentChunk* chunk = dependency->dependentChunks;
+		if (!chunk || chunk->count == DEPENDENT_CHUNK_SIZE)
+		{
+			chunk = AllocateDependentChunk();
+			chunk->next = dependency->dependentChunks;
+			dependency->dependentChunks = chunk;
+		}
+		chunk->dependents[chunk->count] = dependent;
+		chunk->count++;
+	}
+	dependency->dependentCount++;
+}
+
+DependentChunk* JobSystem::AllocateDependentChunk()
+{
+	if (current_arena)
+	{
+		void* memory = current_arena->Allocate(sizeof(DependentChunk), alignof(DependentChunk));
+		if (memory)
+		{
+			return new (memory) DependentChunk;
+		}
+	}
+	DependentChunk* chunk = new DependentChunk;
+	chunk->heapAllocated = true;
+	return chunk;
+}
+
+void JobSystem::AddJob(Job* job, JobPriority priority)
+{
+	job->priority = priority;
+	AddJob(job);
+}
+
+void JobSystem::Run(JobGraph& graph, JobCounter* counter)
+{
+	if (!graph.IsCompiled())
+	{
+		PRINT_ESSENTIAL("Only compiled job graphs can be run.\n");
+		return;
+	}
+#ifdef CRITICAL_PATH_SCHEDULING
+	signed char frame = GetCurrentFrame();
+	graph.Reset(counter, frame);
+	//The path lengths of graph jobs were already computed when the graph was compiled.
+	AddToCriticalPath(frame, graph.GetCriticalPathLength(), graph.GetTotalCost());
+#else
+	graph.Reset(counter);
+#endif
+	if (counter)
+	{
+		counter->value.fetch_add(graph.GetNodeCount(), std::memory_order_relaxed);
+	}
+	PushReadyJobs(graph.GetRoots(), graph.GetRootCount());
+}
+
+void JobSystem::SetCost(Job* job, unsigned int estimatedCost, const void* costKey)
+{
+	job->costKey = costKey;
+	job->cost = costKey ? costTable.Get(costKey, estimatedCost) : estimatedCost;
+	//Zero would be taken for a path that is not computed yet.
+	job->cost = std::max(job->cost, 1u);
+}
+
+unsigned int JobSystem::GetCriticalPathLength()
+{
+	return GetCriticalPath(latestFrame).length;
+}
+
+unsigned long long JobSystem::GetTotalCost()
+{
+	return GetCriticalPath(latestFrame).totalCost;
+}
+
+void JobSystem::AddJob(Job* job, JobCounter* counter)
+{
+	job->counter = counter;
+	if (counter)
+	{
+		//The job can not finish before it is pushed below, so relaxed is enough.
+		counter->value.fetch_add(1, std::memory_order_relaxed);
+	}
+#ifdef CRITICAL_PATH_SCHEDULING
+	//All dependents of the job are known at this point, as dependencies can not be added to jobs already added.
+	//Dependents of those which are set up later are not taken into account, so the path is only an estimate.
+	job->frame = GetCurrentFrame();
+	AddToCriticalPath(job->frame, ComputePathLength(job), job->cost);
+#endif
+	//Resolve the "not added yet" dependency every job starts with. If all real dependencies are finished already the
+	//job is workable right away, otherwise the last finishing dependency will push it.
+	if (--job->dependencyCount == 0)
+	{
+		PushReadyJob(job);
+	}
+}
+
+void JobSystem::PushReadyJob(Job* job)
+{
+#ifdef CRITICAL_PATH_SCHEDULING
+	job->priority = GetPathPriority(job);
+#endif
+#ifdef NUMA_AWARE
+	if (PushToLocalityGroup(job))
+	{
+		NotifyWorker();
+		return;
+	}
+#endif
+	if (thread_id >= 0)
+	{
+		//Jobs spawned by a worker stay on its own queue, so they are likely to run on the same core while the data they
+		//work on is still in its cache. Other workers can still steal them.
+		GetQueue()->Push(job);
+	}
+	else
+	{
+		//Threads outside of the system do not own a queue, so their jobs are injected and picked up by any worker.
+		injectionQueue.Push(job);
+	}
+#ifdef ELASTIC_WORKERS
+	SampleQueueDepth();
+#endif
+	NotifyWorker();
+}
+
+void JobSystem::PushReadyJobs(Job* const* jobs, unsigned int count)
+{
+#ifdef CRITICAL_PATH_SCHEDULING
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		jobs[i]->priority = GetPathPriority(jobs[i]);
+	}
+#endif
+#ifdef NUMA_AWARE
+	//Jobs hinted to another node are handed over one by one, as they go to different queues than the others.
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		if (!PushToLocalityGroup(jobs[i]))
+		{
+			if (thread_id >= 0)
+			{
+				GetQueue()->Push(jobs[i]);
+			}
+			else
+			{
+				injectionQueue.Push(jobs[i]);
+			}
+		}
+	}
+#else
+	if (thread_id >= 0)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			GetQueue()->Push(jobs[i]);
+		}
+	}
+	else
+	{
+		injectionQueue.Push(jobs, count);
+	}
+#endif
+#ifdef ELASTIC_WORKERS
+	SampleQueueDepth();
+#endif
+	//There is no point in waking more workers than there are jobs.
+	for (unsigned int i = 0; i < count && i < queues.size(); ++i)
+	{
+		NotifyWorker();
+	}
+}
+
+void JobSystem::NotifyWorker()
+{
+	//Threads waiting for a counter help working jobs, so they are woken up for new work as well.
+	counterWaiters.NotifyOne();
+#ifdef PARK_ON_EVENT_COUNT
+	//Only costs a system call if a worker is actually parked.
+	idleWorkers.NotifyOne();
+#else
+	//Wake the first sleeping worker, starting at a different one each time so the wake ups are spread over all of them.
+	//If nobody is sleeping there is nothing to do, as every awake worker looks for work again before going to sleep.
+	unsigned int start = wakeIndex.fetch_add(1, std::memory_order_relaxed);
+	for (size_t i = 0; i < queues.size(); ++i)
+	{
+		if (queues[(start + i) % queues.size()]->NotifyOne())
+		{
+			return;
+		}
+	}
+#endif
+}
+
+//Waits until the jobsystem has no job left. This is used so a frame can wait for all it's jobs to be finished.
+void JobSystem::WaitForCounter(JobCounter& counter)
+{
+#ifdef FIBER_JOBS
+	if (current_fiber && counter.value.load(std::memory_order_acquire) != 0 && isRunning)
+	{
+		//The job keeps its stack while suspended, the worker goes on with a fresh fiber until the counter reaches zero.
+		SwitchFiber(AcquireFiber(), FiberAction::WaitForCounter, &counter);
+	}
+#endif
+	//Instead of just blocking, the waiting thread works jobs itself until the counter reaches zero. Called from inside
+	//a job, the jobs are run on top of it, so jobs can wait for other jobs without taking a worker away from the system.
+	//Any job could wait for one depending on the job below though, which can not finish before the one on top does. So
+	//on top of a job only jobs attached to the counter and the jobs they depend on are worked, everything else is left
+	//to the other threads.
+	bool isInsideJob = current_job != nullptr;
+	while (counter.value.load(std::memory_order_acquire) != 0 && isRunning)
+	{
+		Job* job = isInsideJob ? GetJobOfCounter(counter) : GetJobToHelp();
+		if (job)
+		{
+			Execute(job);
+			Finish(job);
+			if (thread_id >= 0)
+			{
+				workerStates[thread_id]->executedJobs++;
+			}
+			continue;
+		}
+		uint32_t key = counterWaiters.PrepareWait();
+		//Check again after registering, the counter could have reached zero or new work could have been pushed in between.
+		if (counter.value.load(std::memory_order_acquire) == 0 || !isRunning || (!isInsideJob && HasAvailableWork()))
+		{
+			counterWaiters.CancelWait();
+			continue;
+		}
+		counterWaiters.Wait(key);
+	}
+	//Whoever brought the counter to zero might still be about to unlock it, the caller could destroy it right after.
+	LockCounter(&counter);
+	UnlockCounter(&counter);
+}
+
+void JobSystem::BlockForCounter(JobCounter& counter)
+{
+	while (counter.value.load(std::memory_order_acquire) != 0 && isRunning)
+	{
+		uint32_t key = counterWaiters.PrepareWait();
+		if (counter.value.load(std::memory_order_acquire) == 0 || !isRunning)
+		{
+			counterWaiters.CancelWait();
+			break;
+		}
+		counterWaiters.Wait(key);
+	}
+	//Whoever brought the counter to zero might still be about to unlock it, the caller could destroy it right after.
+	LockCounter(&counter);
+	UnlockCounter(&counter);
+}
+
+void JobSystem::AddJobAfterCounter(Job* job, JobCounter& counter, CounterWaiter& waiter)
+{
+	//ReleaseCounter takes the same lock to take the waiters once the counter reached zero, so either it finds the waiter
+	//or we see the counter at zero.
+	LockCounter(&counter);
+	bool isDone = !MarkCounterWaited(&counter);
+	if (!isDone)
+	{
+		waiter.job = job;
+		waiter.next = counter.waiters;
+		counter.waiters = &waiter;
+	}
+	UnlockCounter(&counter);
+	if (isDone)
+	{
+		AddJob(job);
+	}
+}
+
+void JobSystem::AttachToCounter(JobCounter& counter)
+{
+	//Whatever is attached can not be released before this returns, so relaxed is enough like in AddJob.
+	counter.value.fetch_add(1, std::memory_order_relaxed);
+}
+
+void JobSystem::ReleaseCounter(JobCounter* counter)
+{
+	//Releasing makes everything the job did visible to whoever sees the counter reach zero. Unless anyone waits in the
+	//lists of the counter, that is all there is to do, the counter may be gone right after.
+	unsigned int value = counter->value.fetch_sub(1, std::memory_order_acq_rel);
+	bool reachedZero = (value & ~COUNTER_HAS_WAITERS) == 1;
+#ifdef FIBER_JOBS
+	JobFiber* waitingFibers = nullptr;
+#endif
+	CounterWaiter* waiters = nullptr;
+	if (reachedZero && (value & COUNTER_HAS_WAITERS))
+	{
+		//The flag keeps the counter from reading zero until the lists are taken, WaitForCounter then takes the lock
+		//before returning to keep the counter alive until it is unlocked here. Waiters registering in the meantime see
+		//no jobs left and do not wait anymore.
+		LockCounter(counter);
+#ifdef FIBER_JOBS
+		waitingFibers = counter->waitingFibers;
+		counter->waitingFibers = nullptr;
+#endif
+		waiters = counter->waiters;
+		counter->waiters = nullptr;
+		counter->value.fetch_and(~COUNTER_HAS_WAITERS, std::memory_order_release);
+		UnlockCounter(counter);
+	}
+#ifdef FIBER_JOBS
+	while (waitingFibers)
+	{
+		JobFiber* next = waitingFibers->next;
+		PushReadyFiber(waitingFibers);
+		waitingFibers = next;
+	}
+#endif
+	//The waiter can be gone as soon as its job is added.
+	while (waiters)
+	{
+		CounterWaiter* next = waiters->next;
+		AddJob(waiters->job);
+		waiters = next;
+	}
+	if (reachedZero)
+	{
+		//If the group has no more jobs notify. (So frame can end.)
+		counterWaiters.NotifyAll();
+	}
+}
+
+bool JobSystem::MarkCounterWaited(JobCounter* counter)
+{
+	//Setting the flag and reading the number of jobs at once, the job bringing it to zero either sees the flag or we see
+	//the counter at zero.
+	unsigned int value = counter->value.fetch_or(COUNTER_HAS_WAITERS, std::memory_order_acq_rel);
+	if ((value & ~COUNTER_HAS_WAITERS) != 0)
+	{
+		return true;
+	}
+	//Nothing to wait for, so the flag must not keep the counter from reading zero. If it was set already, whoever
+	//brought the counter to zero is about to take the lists and clear it.
+	if (!(value & COUNTER_HAS_WAITERS))
+	{
+		counter->value.fetch_and(~COUNTER_HAS_WAITERS, std::memory_order_relaxed);
+	}
+	return false;
+}
+
+void JobSystem::LockCounter(JobCounter* counter)
+{
+	while (counter->locked.exchange(true, std::memory_order_acquire))
+	{
+		while (counter->locked.load(std::memory_order_relaxed))
+		{
+			CpuRelax();
+		}
+	}
+}
+
+void JobSystem::UnlockCounter(JobCounter* counter)
+{
+	counter->locked.store(false, std::memory_order_release);
 }
 
-void JobSystem::JoinJobs()
+Job* JobSystem::GetJobToHelp()
 {
-	//stop the jobsystem
-	isRunning = false;
-	//stop potentially picking up new jobs
-	stopped = true;
-	//wake up all threads
-	WakeAll();
-	//wait for each thread to join
-	for (auto& worker : workers)
+	if (thread_id >= 0)
 	{
-		worker.join();
+		Job* job = GetJob();
+		return job ? job : StealJob();
+	}
+	//Threads outside of the system have no queue to put a batch of stolen jobs in, so they take single jobs only.
+	for (int priority = 0; priority < JOB_PRIORITY_COUNT; ++priority)
+	{
+		Job* job = injectionQueue.Pop(static_cast<JobPriority>(priority));
+#ifdef NUMA_AWARE
+		for (size_t i = 0; i < workerGroups.size() && !job; ++i)
+		{
+			job = workerGroups[i]->injectionQueue.Pop(static_cast<JobPriority>(priority));
+		}
+#endif
+		for (size_t i = 0; i < queues.size() && !job; ++i)
+		{
+			queues[i]->StealHalf(static_cast<JobPriority>(priority), &job, 1);
+		}
+		if (job)
+		{
+			return job;
+		}
 	}
+	return nullptr;
 }
 
-Job* JobSystem::CreateJob(JobFunction jobFunction)
+Job* JobSystem::GetJobOfCounter(JobCounter& counter)
 {
-	Job* job = new Job;
-	job->jobFunction = jobFunction;
+	//Jobs added by the waiting job are at the private end of our own queue, or in the injection queue if we are outside
+	//of the system. Jobs of the counter in the queues of other workers are left to them and the thieves. Besides the jobs
+	//attached to the counter, the ones they depend on are needed as well, which may not be attached to anything.
+	Job* job = injectionQueue.Pop(&counter);
+#ifdef NUMA_AWARE
+	for (size_t i = 0; i < workerGroups.size() && !job; ++i)
+	{
+		job = workerGroups[i]->injectionQueue.Pop(&counter);
+	}
+#endif
+	if (job || thread_id < 0)
+	{
+		return job;
+	}
+	//Other jobs can be on top of them, like ones the jobs of the counter added. Those are put back in their order once
+	//a job is found or the queue is empty, the thread only blocks after looking through all of them.
+	std::vector<Job*>& skippedJobs = workerStates[thread_id]->skippedJobs;
+	for (int priority = 0; priority < JOB_PRIORITY_COUNT && !job; ++priority)
+	{
+		while ((job = GetQueue()->Pop(static_cast<JobPriority>(priority))) && !IsJobNeededByCounter(job, &counter))
+		{
+			skippedJobs.push_back(job);
+		}
+	}
+	while (!skippedJobs.empty())
+	{
+		GetQueue()->Push(skippedJobs.back());
+		skippedJobs.pop_back();
+	}
 	return job;
 }
 
-void JobSystem::AddDependency(Job* dependent, Job* dependency)
+FrameArena* JobSystem::BeginFrame()
 {
-	if (dependency->dependentCount > MAX_DEPENDENT_COUNT-1) {
-		//We only support a max amount of dependcies so job struct stays the size of two cache lines to be cache friendly
-		PRINT_ESSENTIAL(("Jobsystem only supports a max of " + std::to_string(MAX_DEPENDENT_COUNT) + " dependents.\n").c_str());
-		exit(1);
-	}
-	else {
-		// Add dependent to the job.
-		dependency->dependents[dependency->dependentCount] = dependent;
-		dependency->dependentCount++;
-		// Increase dependency count, blocking this job until all dependencies are resolved
-		dependent->dependencyCount++;
+	//Look for the next arena not used by a frame still in flight.
+	for (unsigned int i = 0; i < frameArenas.size(); ++i)
+	{
+		unsigned int index = nextFrameArena.fetch_add(1, std::memory_order_relaxed) % frameArenas.size();
+		FrameArena* arena = frameArenas[index];
+		if (!arena->inUse.exchange(true, std::memory_order_acquire))
+		{
+			//The frame that used the arena before is done, so its critical path can start over.
+			criticalPaths[index].length = 0;
+			criticalPaths[index].totalCost = 0;
+			latestFrame = index;
+			current_arena = arena;
+			return arena;
+		}
 	}
+	PRINT_ESSENTIAL("All frame arenas are in use, increase FRAME_ARENA_COUNT.\n");
+	GetCriticalPath(-1).length = 0;
+	GetCriticalPath(-1).totalCost = 0;
+	latestFrame = -1;
+	current_arena = nullptr;
+	return nullptr;
 }
 
-void JobSystem::AddJob(Job* job)
-{
-	jobsToDo++;
-	job->queue = queues[current_queue_index];
-	queues[current_queue_index]->Push(job);
-	//Current queue index gets increased with wrap around, thus jobs get added to queues in a round robing fashion.
-	current_queue_index = ((current_queue_index + 1) % static_cast<int>(queues.size()));
-}
-
-//Waits until the jobsystem has no job left. This is used so a frame can wait for all it's jobs to be finished.
-void JobSystem::WaitForAllJobs()
+void JobSystem::EndFrame(FrameArena* arena)
 {
-	std::unique_lock<std::mutex> lock(waitForAllJobMutex);
-	//Predicate checks if jobsystem has no more jobs to do or it has stopped running.
-	allJobsDoneConditionalVariable.wait(lock, [&]()
-		{
-			return !isRunning || jobsToDo==0;
-		});
+#ifdef ELASTIC_WORKERS
+	AdaptWorkerCount();
+#endif
+	if (!arena)
+	{
+		return;
+	}
+	if (current_arena == arena)
+	{
+		current_arena = nullptr;
+	}
+	arenaOverflows += arena->GetOverflows();
+	arena->Reset();
+	arena->inUse.store(false, std::memory_order_release);
 }
 
 //The worker thread
@@ -137,30 +962,234 @@ void JobSystem::Worker(unsigned int id)
 	OPTICK_THREAD(("WORKER #" + std::to_string(id)).c_str());
 	//Set thread local variable to its specifc id, so it can be used to access thread specific queue.
 	thread_id = id;
+#ifdef PIN_WORKERS
+	if (!CpuTopology::PinCurrentThread(workerStates[id]->cpu))
+	{
+		PRINT_ESSENTIAL(("Could not pin worker #" + std::to_string(id) + " to CPU " + std::to_string(workerStates[id]->cpu.id) + ".\n").c_str());
+	}
+#endif
+#ifdef NUMA_AWARE
+	AllocateWorkerData(id);
+#endif
+#ifdef FIBER_JOBS
+	//The worker loop runs on fibers of the pool, so a job waiting for a counter can be suspended together with its
+	//fiber. The thread's own fiber is only switched back to once the system stopped.
+	JobFiber threadFiber;
+	threadFiber.fiber = Fiber::ConvertCurrentThread();
+	threadFiber.isThreadFiber = true;
+#if USE_OPTICK
+	threadFiber.optickStorage = *Optick::GetEventStorageSlotForCurrentThread();
+#endif
+	workerStates[id]->threadFiber = &threadFiber;
+	current_fiber = &threadFiber;
+	SwitchFiber(AcquireFiber(), FiberAction::None);
+	current_fiber = nullptr;
+	Fiber::RevertCurrentThread(threadFiber.fiber);
+#else
+	WorkerLoop();
+#endif
+	//Need to call this here otherwise we get stuck in ParallelUpdate if we quit early, as it waits for the jobs of the
+	//frame to end, which will not happen anymore.
+	counterWaiters.NotifyAll();
+	PRINTW(thread_id, "Exiting...");
+}
+
+void JobSystem::WorkerLoop()
+{
 	while (isRunning)
 	{
+#ifdef FIBER_JOBS
+		//Jobs that were already started come first.
+		if (ResumeReadyFiber())
+		{
+			continue;
+		}
+#endif
+#ifdef ELASTIC_WORKERS
+		//With FIBER_JOBS the loop can continue on another thread after a job was suspended, so the id is read every time.
+		unsigned int id = thread_id;
+		if (ParkIfInactive(id))
+		{
+			continue;
+		}
+		auto waitStart = std::chrono::steady_clock::now();
 		WaitForAvailableJobs();
+		idleTimes[id].nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - waitStart).count(), std::memory_order_relaxed);
+#else
+		WaitForAvailableJobs();
+#endif
 		if (!stopped) {
 			//Try to work a job from its own queue.
 			if (!TryToWorkJob()) {
-				//If that did not work try to steal a job.
-				StealJob();
-				//And try to work that job.
-				TryToWorkJob();
+#ifdef ELASTIC_WORKERS
+				//Workers that are about to park only finish what is left in their own queue.
+				if (static_cast<unsigned int>(thread_id) >= activeWorkerCount)
+				{
+					continue;
+				}
+#endif
+				//If that did not work try to steal a job and work it right away.
+				Job* job = StealJob();
+				if (job)
+				{
+					Execute(job);
+					Finish(job);
+					workerStates[thread_id]->executedJobs++;
+				}
 			}
 		}
 	}
-	//Need to call this here otherwise we get stuck in ParallelUpdate if we quit early, as it waits for all jobs to end.
-	allJobsDoneConditionalVariable.notify_all();
-	PRINTW(thread_id, "Exiting...");
 }
 
+#ifdef FIBER_JOBS
+void JobSystem::FiberMain(void* jobSystem)
+{
+	JobSystem* self = static_cast<JobSystem*>(jobSystem);
+	self->CompleteSwitch();
+	while (true)
+	{
+		self->WorkerLoop();
+		//The system stopped, so the thread goes back to its own fiber to end. Should this fiber ever be switched to
+		//again, it finds the system stopped as well.
+		self->SwitchFiber(self->workerStates[thread_id]->threadFiber, FiberAction::Release);
+	}
+}
+
+JobFiber* JobSystem::AcquireFiber()
+{
+	std::lock_guard<std::mutex> guard(fiberPoolMutex);
+	JobFiber* fiber = freeFibers;
+	if (!fiber)
+	{
+		return CreateFiber();
+	}
+	freeFibers = fiber->next;
+	fiber->next = nullptr;
+	return fiber;
+}
+
+JobFiber* JobSystem::CreateFiber()
+{
+	JobFiber* fiber = new JobFiber();
+	fiber->fiber = new Fiber(FIBER_STACK_SIZE, &JobSystem::FiberMain, this);
+#if USE_OPTICK
+	Optick::RegisterFiber(reinterpret_cast<uint64_t>(fiber), &fiber->optickStorage);
+#endif
+	fibers.push_back(fiber);
+	return fiber;
+}
+
+void JobSystem::SwitchFiber(JobFiber* fiber, FiberAction action, JobCounter* counter)
+{
+	JobFiber* currentFiber = current_fiber;
+	currentFiber->currentJob = current_job;
+	currentFiber->currentArena = current_arena;
+#if USE_OPTICK
+	if (!currentFiber->isThreadFiber)
+	{
+		Optick::FiberSyncData::DetachFromThread(currentFiber->optickStorage);
+	}
+#endif
+	WorkerState* workerState = workerStates[thread_id];
+	workerState->previousFiber = currentFiber;
+	workerState->pendingAction = action;
+	workerState->pendingCounter = counter;
+	current_fiber = fiber;
+	Fiber::Switch(currentFiber->fiber, fiber->fiber);
+	CompleteSwitch();
+}
+
+void JobSystem::CompleteSwitch()
+{
+	JobFiber* fiber = current_fiber;
+	current_job = fiber->currentJob;
+	current_arena = fiber->currentArena;
+#if USE_OPTICK
+	//Events recorded from now on go into the storage of the fiber, which Optick shows on this thread until it detaches.
+	*Optick::GetEventStorageSlotForCurrentThread() = fiber->optickStorage;
+	if (!fiber->isThreadFiber)
+	{
+		Optick::FiberSyncData::AttachToThread(fiber->optickStorage, Fiber::GetCurrentThreadId());
+	}
+#endif
+	WorkerState* workerState = workerStates[thread_id];
+	JobFiber* previousFiber = workerState->previousFiber;
+	switch (workerState->pendingAction)
+	{
+	case FiberAction::Release:
+	{
+		std::lock_guard<std::mutex> guard(fiberPoolMutex);
+		previousFiber->next = freeFibers;
+		freeFibers = previousFiber;
+		break;
+	}
+	case FiberAction::WaitForCounter:
+	{
+		//The job bringing the counter to zero takes the same lock to take the waiting fibers, so either it finds the
+		//fiber waiting or we see the counter at zero.
+		JobCounter* counter = workerState->pendingCounter;
+		LockCounter(counter);
+		bool isDone = !isRunning || !MarkCounterWaited(counter);
+		if (!isDone)
+		{
+			previousFiber->next = counter->waitingFibers;
+			counter->waitingFibers = previousFiber;
+		}
+		UnlockCounter(counter);
+		if (isDone)
+		{
+			PushReadyFiber(previousFiber);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+	workerState->pendingAction = FiberAction::None;
+}
+
+bool JobSystem::ResumeReadyFiber()
+{
+	if (readyFiberCount.load(std::memory_order_relaxed) == 0)
+	{
+		return false;
+	}
+	JobFiber* fiber = nullptr;
+	{
+		std::lock_guard<std::mutex> guard(readyFibersMutex);
+		if (readyFibers.empty())
+		{
+			return false;
+		}
+		fiber = readyFibers.front();
+		readyFibers.pop_front();
+		readyFiberCount--;
+	}
+	//We are between two jobs, so nothing is left on the stack of the current fiber and it can go back into the pool.
+	SwitchFiber(fiber, FiberAction::Release);
+	return true;
+}
+
+void JobSystem::PushReadyFiber(JobFiber* fiber)
+{
+	{
+		std::lock_guard<std::mutex> guard(readyFibersMutex);
+		fiber->next = nullptr;
+		readyFibers.push_back(fiber);
+		readyFiberCount++;
+	}
+	NotifyWorker();
+}
+#endif
+
 bool JobSystem::TryToWorkJob() {
 	auto job = GetJob();
-	if (CanExecuteJob(job))
+	//Only jobs without unresolved dependencies are ever in a queue, so every job we get can be executed.
+	if (job)
 	{
 		Execute(job);
 		Finish(job);
+		workerStates[thread_id]->executedJobs++;
 		return true;
 	}
 	return false;
@@ -171,11 +1200,79 @@ void JobSystem::WaitForAvailableJobs()
 	//if we are stopped don't wait to allow exiting
 	if (!stopped)
 	{
+#ifdef PARK_ON_EVENT_COUNT
+		//Short jobs would be dominated by the time it takes the kernel to wake us up again, so first spin for a bit.
+		for (unsigned int i = 0; i < IDLE_SPIN_COUNT; ++i)
+		{
+			if (HasAvailableWork() || !isRunning)
+			{
+				return;
+			}
+			CpuRelax();
+		}
+		//Then give other threads on this core a chance to run.
+		for (unsigned int i = 0; i < IDLE_YIELD_COUNT; ++i)
+		{
+			if (HasAvailableWork() || !isRunning)
+			{
+				return;
+			}
+			std::this_thread::yield();
+		}
+		// If there is still nothing else to do, go to sleep. Work pushed after PrepareWait will wake us up, work pushed
+		// before is seen by the check after it.
+		PRINTW(thread_id, "Sleeping...");
+		uint32_t key = idleWorkers.PrepareWait();
+		if (HasAvailableWork() || !isRunning)
+		{
+			idleWorkers.CancelWait();
+			return;
+		}
+		idleWorkers.Wait(key);
+		PRINTW(thread_id, "Waking...");
+#else
 		// If there is nothing else to do, go to sleep
 		PRINTW(thread_id, "Sleeping...");
 		GetQueue()->WaitForJob();
 		PRINTW(thread_id, "Waking...");
+#endif
+	}
+}
+
+bool JobSystem::IsOwnQueueEmpty()
+{
+	return thread_id >= 0 ? GetQueue()->IsEmpty() : injectionQueue.IsEmpty();
+}
+
+bool JobSystem::HasAvailableWork()
+{
+	if (!injectionQueue.IsEmpty())
+	{
+		return true;
+	}
+	//Suspended fibers can only be resumed by workers.
+	if (thread_id >= 0 && readyFiberCount.load(std::memory_order_relaxed) > 0)
+	{
+		return true;
+	}
+#ifdef NUMA_AWARE
+	for (WorkerGroup* group : workerGroups)
+	{
+		if (!group->injectionQueue.IsEmpty())
+		{
+			return true;
+		}
+	}
+#endif
+	//Jobs in any queue are available to us, either as owner or by stealing them.
+	for (JobQueue* queue : queues)
+	{
+		if (!queue->IsEmpty())
+		{
+			return true;
+		}
 	}
+	return false;
 }
 
 JobQueue* JobSystem::GetQueue() {
@@ -183,74 +1280,374 @@ JobQueue* JobSystem::GetQueue() {
 	//Gets the thread specific queue using the thread local stored thread id
 	return queues[thread_id];
 }
+JobPool* JobSystem::GetPool() {
+	if (thread_id < 0)
+	{
+		return nullptr;
+	}
+	return pools[thread_id];
+}
+
 Job* JobSystem::GetJob()
 {
 	PRINTW(thread_id, "GetJob");
+#ifdef PRIORITY_STARVATION_LIMIT
+	WorkerState* workerState = workerStates[thread_id];
+	if (workerState->takenJobs >= PRIORITY_STARVATION_LIMIT - 1)
+	{
+		//Give the lowest priority with any work a turn, if there is none this is just a normal pick.
+		for (int priority = JOB_PRIORITY_COUNT - 1; priority >= 0; --priority)
+		{
+			Job* job = GetJob(static_cast<JobPriority>(priority));
+			if (job)
+			{
+				workerState->takenJobs = 0;
+				return job;
+			}
+		}
+		return nullptr;
+	}
+#endif
+	for (int priority = 0; priority < JOB_PRIORITY_COUNT; ++priority)
+	{
+		Job* job = GetJob(static_cast<JobPriority>(priority));
+		if (job)
+		{
+#ifdef PRIORITY_STARVATION_LIMIT
+			workerState->takenJobs++;
+#endif
+			return job;
+		}
+	}
+	return nullptr;
+}
+
+Job* JobSystem::GetJob(JobPriority priority)
+{
 	//Getting a job from the own queue uses the private end of it with Pop()
-	Job* job = GetQueue()->Pop();
+	Job* job = GetQueue()->Pop(priority);
+#ifdef NUMA_AWARE
+	if (!job)
+	{
+		//Jobs hinted to our node come before anything injected from outside of the system.
+		job = workerGroups[workerStates[thread_id]->group]->injectionQueue.Pop(priority);
+	}
+#endif
+	if (!job)
+	{
+		//Only when there is no local work of this priority pick up jobs injected from outside of the system.
+		job = injectionQueue.Pop(priority);
+	}
 	return job;
 }
 
-void JobSystem::StealJob() {
+Job* JobSystem::StealJob() {
 	PRINTW(thread_id, "StealJob");
-	//Use a random index to acces another queue
-	int randomIndex = rand() % queues.size();
-	//Are we actually accesing a foreign queue
-	if(randomIndex!=thread_id){
-		//Stealing uses the public end of the queue with Steal()
-		auto job = GetQueue()->Steal();
-		if (job) {
-			//If we got a job we add it to the private end of our own queue
-			JobQueue* queue = GetQueue();
-			job->queue = queue;
-			queue->Push(job);
+	//High priority jobs are stolen from all workers before any lower priority job is.
+	for (int priority = 0; priority < JOB_PRIORITY_COUNT; ++priority)
+	{
+		Job* job = StealJob(static_cast<JobPriority>(priority));
+		if (job)
+		{
+			return job;
 		}
 	}
+	workerStates[thread_id]->failedSteals++;
+	workerStates[thread_id]->lastVictim = -1;
+	return nullptr;
 }
 
-bool JobSystem::CanExecuteJob(Job* job)
+Job* JobSystem::StealJob(JobPriority priority)
 {
-	PRINTW(thread_id, "CanExecuteJob");
-	//Did we actually get a job
-	if (job)
+	Job* job = nullptr;
+	int lastVictim = -1;
+#ifdef STEAL_VICTIM_AFFINITY
+	//A victim that had work to steal last time likely still has more, e.g. because it spawned a lot of jobs.
+	lastVictim = workerStates[thread_id]->lastVictim;
+#ifdef NUMA_AWARE
+	//Another node is only stolen from once nothing is left on our own one, which the sweep below takes care of.
+	if (lastVictim >= 0 && workerStates[lastVictim]->group != workerStates[thread_id]->group)
+	{
+		lastVictim = -1;
+	}
+#endif
+#endif
+#ifdef PIN_WORKERS
+	//Victims are tried closest first, as their jobs likely work on data that is in a cache we share with them. Within a
+	//group of equally close victims we start at a random one, so the thieves do not all line up at the same victim.
+	//The last victim is only preferred over the others of its group, it must not take us past a closer one.
+	WorkerState* workerState = workerStates[thread_id];
+	size_t groupBegin = 0;
+	for (size_t group = 0; group < workerState->victimGroupEnds.size() && !job; ++group)
 	{
-		//This jobs still depends on another job finishing
-		if (job->dependencyCount > 0)
+		size_t groupEnd = workerState->victimGroupEnds[group];
+		size_t groupSize = groupEnd - groupBegin;
+		for (size_t i = groupBegin; i < groupEnd && !job; ++i)
 		{
-			// Add job back to queue for later
-			GetQueue()->Push(job);
-			return false;
+			if (workerState->victims[i] == lastVictim)
+			{
+				job = StealFrom(lastVictim, priority);
+			}
 		}
-		else
+		size_t start = NextRandom() % groupSize;
+		for (size_t i = 0; i < groupSize && !job; ++i)
 		{
-			return true;
+			int victim = workerState->victims[groupBegin + (start + i) % groupSize];
+			if (victim != lastVictim)
+			{
+				job = StealFrom(victim, priority);
+			}
 		}
+		groupBegin = groupEnd;
 	}
-	return false;
+#else
+	if (lastVictim >= 0)
+	{
+		job = StealFrom(lastVictim, priority);
+	}
+	if (!job)
+	{
+		//Sweep over all other queues, starting at a random one so the thieves do not all line up at the same victim.
+		int queueCount = static_cast<int>(queues.size());
+		int start = static_cast<int>(NextRandom() % queues.size());
+		for (int i = 0; i < queueCount && !job; ++i)
+		{
+			int victim = (start + i) % queueCount;
+			if (victim != thread_id)
+			{
+				job = StealFrom(victim, priority);
+			}
+		}
+	}
+#endif
+#ifdef NUMA_AWARE
+	if (!job)
+	{
+		//Only once nothing is left on any worker, jobs that were meant for another node are taken.
+		job = StealFromOtherGroups(priority);
+	}
+#endif
+	return job;
+}
+
+Job* JobSystem::StealFrom(int victim, JobPriority priority)
+{
+	//Stealing uses the public end of the queue
+	Job* jobs[STEAL_BATCH_SIZE];
+	size_t count = queues[victim]->StealHalf(priority, jobs, STEAL_BATCH_SIZE);
+	if (count == 0)
+	{
+		return nullptr;
+	}
+	WorkerState* workerState = workerStates[thread_id];
+	workerState->successfulSteals++;
+	workerState->stolenJobs += count;
+	workerState->lastVictim = victim;
+	//The oldest job is worked right away, the others go onto the private end of our own queue. Other idle workers can
+	//steal them from there again, so let them know.
+	for (size_t i = 1; i < count; ++i)
+	{
+		GetQueue()->Push(jobs[i]);
+	}
+	if (count > 1)
+	{
+		NotifyWorker();
+	}
+	return jobs[0];
+}
+
+unsigned int JobSystem::NextRandom()
+{
+	//xorshift32, which is cheap and, other than rand(), does not share any state between threads.
+	unsigned int& state = workerStates[thread_id]->randomState;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
 }
 
 void JobSystem::Execute(Job* job)
 {
 	PRINTW(thread_id, "Execute");
-	//In a real world application, we would probably also allow for passing of data to the jobFunction.
-	job->jobFunction();
+	//Jobs can run other jobs while waiting for a counter, so the outer job has to be restored afterwards.
+	Job* outerJob = current_job;
+	current_job = job;
+#ifdef CRITICAL_PATH_SCHEDULING
+	if (job->costKey)
+	{
+		//Measure the job, so jobs with the same key get a better estimate in the next frames.
+		auto start = std::chrono::steady_clock::now();
+		job->invoke(job);
+		auto end = std::chrono::steady_clock::now();
+		costTable.Record(job->costKey, static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()));
+		current_job = outerJob;
+		return;
+	}
+#endif
+	//Calls the callable stored in the job's payload, which carries whatever data the job needs.
+	job->invoke(job);
+	current_job = outerJob;
 }
 
 void JobSystem::Finish(Job* job)
 {
 	PRINTW(thread_id, "Finish");
-	//deleting the job also updates dependencies
-	delete job;
-	jobsToDo--;
-	if (jobsToDo == 0) {
-		//If we have no more jobs notify. (So frame can end.)
-		allJobsDoneConditionalVariable.notify_all();
+	//The job is gone once it is handed back below.
+	JobCounter* counter = job->counter;
+	bool persistent = job->persistent;
+	//From now on no late dependents can be added, wait for anyone in the middle of adding one. Anyone seeing the job
+	//finished also sees what it wrote.
+	unsigned char state = 0;
+	while (!job->dependentsState.compare_exchange_weak(state, JOB_DEPENDENTS_FINISHED, std::memory_order_acq_rel, std::memory_order_relaxed))
+	{
+		state = 0;
+		CpuRelax();
+	}
+	//Job is finished, so dependents can reduce dependencyCount.
+	ReadyJobs readyJobs;
+	unsigned int inlineDependentCount = std::min(job->dependentCount, static_cast<unsigned int>(MAX_INLINE_DEPENDENT_COUNT));
+	for (unsigned int i = 0; i < inlineDependentCount; ++i)
+	{
+		ReleaseDependent(job->dependents[i], readyJobs);
+	}
+	for (DependentChunk* chunk = job->dependentChunks; chunk; chunk = chunk->next)
+	{
+		for (unsigned int i = 0; i < chunk->count; ++i)
+		{
+			ReleaseDependent(chunk->dependents[i], readyJobs);
+		}
+	}
+	PushReadyJobs(readyJobs);
+	//Persistent jobs belong to a graph, which reuses them for its next run, or to a handle, which frees them once their
+	//result is not needed anymore. Handles do not wait for a counter, so they have to be told when the job is not
+	//touched here anymore.
+	if (persistent)
+	{
+		job->dependentsState.store(JOB_DEPENDENTS_FINISHED | JOB_DEPENDENTS_RELEASED, std::memory_order_release);
+	}
+	else
+	{
+		FreeJob(job);
+	}
+	if (counter)
+	{
+		ReleaseCounter(counter);
+	}
+}
+
+void JobSystem::FreeJob(Job* job)
+{
+	//Hand the job back to the pool it came from. Only its owner may use the free list directly.
+	if (!job->pool)
+	{
+		//The memory of arena jobs is released all at once in EndFrame. Until then the job stays intact, so late
+		//dependents can still see that it is finished.
+		job->Release();
+	}
+	else if (job->pool == GetPool())
+	{
+		job->pool->Free(job);
+	}
+	else
+	{
+		job->pool->Return(job);
+	}
+}
+
+void JobSystem::ReleaseDependent(Job* dependent, ReadyJobs& readyJobs)
+{
+	//The one bringing the dependency count to zero pushes the dependent.
+	if (--dependent->dependencyCount == 0)
+	{
+		if (readyJobs.count == MAX_INLINE_DEPENDENT_COUNT)
+		{
+			PushReadyJobs(readyJobs);
+		}
+		readyJobs.jobs[readyJobs.count++] = dependent;
+	}
+}
+
+void JobSystem::PushReadyJobs(ReadyJobs& readyJobs)
+{
+#ifdef CRITICAL_PATH_SCHEDULING
+	std::sort(readyJobs.jobs, readyJobs.jobs + readyJobs.count, [](Job* a, Job* b) { return a->pathLength < b->pathLength; });
+#endif
+	PushReadyJobs(readyJobs.jobs, readyJobs.count);
+	readyJobs.count = 0;
+}
+
+unsigned int JobSystem::ComputePathLength(Job* job)
+{
+	if (job->pathLength == 0)
+	{
+		unsigned int longestDependentPath = 0;
+		unsigned int inlineDependentCount = std::min(job->dependentCount, static_cast<unsigned int>(MAX_INLINE_DEPENDENT_COUNT));
+		for (unsigned int i = 0; i < inlineDependentCount; ++i)
+		{
+			longestDependentPath = std::max(longestDependentPath, ComputePathLength(job->dependents[i]));
+		}
+		for (DependentChunk* chunk = job->dependentChunks; chunk; chunk = chunk->next)
+		{
+			for (unsigned int i = 0; i < chunk->count; ++i)
+			{
+				longestDependentPath = std::max(longestDependentPath, ComputePathLength(chunk->dependents[i]));
+			}
+		}
+		job->pathLength = job->cost + longestDependentPath;
+	}
+	return job->pathLength;
+}
+
+signed char JobSystem::GetCurrentFrame()
+{
+	if (current_arena)
+	{
+		for (size_t i = 0; i < frameArenas.size(); ++i)
+		{
+			if (frameArenas[i] == current_arena)
+			{
+				return static_cast<signed char>(i);
+			}
+		}
+	}
+	return current_job ? current_job->frame : -1;
+}
+
+CriticalPath& JobSystem::GetCriticalPath(int frame)
+{
+	return criticalPaths[frame < 0 ? criticalPaths.size() - 1 : frame];
+}
+
+void JobSystem::AddToCriticalPath(int frame, unsigned int pathLength, unsigned long long cost)
+{
+	CriticalPath& criticalPath = GetCriticalPath(frame);
+	unsigned int longestPathLength = criticalPath.length.load(std::memory_order_relaxed);
+	while (pathLength > longestPathLength && !criticalPath.length.compare_exchange_weak(longestPathLength, pathLength, std::memory_order_relaxed));
+	criticalPath.totalCost.fetch_add(cost, std::memory_order_relaxed);
+}
+
+JobPriority JobSystem::GetPathPriority(Job* job)
+{
+	//Jobs that have more than two thirds of the critical path ahead of them are the ones the frame waits for, jobs with
+	//less than a third have plenty of time left.
+	unsigned long long pathLength = job->pathLength;
+	unsigned long long longestPathLength = GetCriticalPath(job->frame).length.load(std::memory_order_relaxed);
+	if (pathLength * 3 >= longestPathLength * 2)
+	{
+		return JobPriority::High;
+	}
+	if (pathLength * 3 >= longestPathLength)
+	{
+		return JobPriority::Normal;
 	}
+	return JobPriority::Low;
 }
 
 void JobSystem::WakeAll() {
-	for (int i = 0; i < queues.size(); ++i) {
-		//Only need to use notify_one instead of all, as there is only one worker waiting per queue.
+	idleWorkers.NotifyAll();
+	parkedWorkers.NotifyAll();
+	for (size_t i = 0; i < queues.size(); ++i) {
+		//Only one worker waits per queue, so waking it is enough.
 		queues[i]->NotifyOne();
 	}
 }
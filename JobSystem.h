@@ -1,48 +1,584 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <vector>   
+#include "CostTable.h"
+#include "CpuTopology.h"
+#include "EventCount.h"
+#include "Fiber.h"
+#include "FrameArena.h"
+#include "JobGraph.h"
+#include "JobPool.h"
 #include "JobQueue.h"
 
 
+namespace Optick
+{
+	struct EventStorage;
+}
+
+//What the job system keeps for each fiber, only used with FIBER_JOBS.
+struct JobFiber
+{
+	Fiber* fiber = nullptr;
+	//Next fiber in the free list of the pool or waiting for the same counter
+	JobFiber* next = nullptr;
+	//Thread local state of the job running on the fiber, which has to move with it from thread to thread.
+	Job* currentJob = nullptr;
+	FrameArena* currentArena = nullptr;
+	//Storage Optick records the events of the fiber into, so they stay together whichever thread runs it.
+	Optick::EventStorage* optickStorage = nullptr;
+	//Set for the fiber a worker thread was converted into, which is not part of the pool.
+	bool isThreadFiber = false;
+};
+
+//What the fiber switched to has to do with the fiber switched away from, as that one can only be touched once it is no
+//longer running.
+enum class FiberAction : unsigned char
+{
+	None,
+	//Put it back into the pool
+	Release,
+	//Add it to the waiting fibers of a counter, or resume it right away if the counter already reached zero
+	WaitForCounter,
+};
+
+//State only ever touched by one worker (and read after it joined). Aligned, so workers do not share cache lines.
+struct alignas(64) WorkerState
+{
+	//State of the xorshift random number generator used to pick steal victims
+	unsigned int randomState = 0;
+	//Queue index of the last successful steal, -1 if the last attempt failed
+	int lastVictim = -1;
+	size_t executedJobs = 0;
+	size_t successfulSteals = 0;
+	//Number of jobs taken by successful steals, each steal takes up to STEAL_BATCH_SIZE jobs
+	size_t stolenJobs = 0;
+	//Number of times a worker looked at all other queues without finding anything to steal
+	size_t failedSteals = 0;
+	//Jobs taken from the own and the injection queue since the lowest priority got its last turn
+	unsigned int takenJobs = 0;
+	//CPU the worker is pinned to, only with PIN_WORKERS
+	CpuInfo cpu;
+	//Queue indices of the other workers, closest CPU first. Only with PIN_WORKERS.
+	std::vector<int> victims;
+	//End of each group of equally close victims in victims
+	std::vector<size_t> victimGroupEnds;
+	//Index of the worker group of the worker's NUMA node, only with NUMA_AWARE.
+	int group = 0;
+	//Jobs pushed since the worker last sampled the queue depth, only with ELASTIC_WORKERS.
+	unsigned int pushesSinceSample = 0;
+	//Fiber the worker thread was converted into, only with FIBER_JOBS.
+	JobFiber* threadFiber = nullptr;
+	//Fiber the worker thread switched away from last and what has to be done with it.
+	JobFiber* previousFiber = nullptr;
+	FiberAction pendingAction = FiberAction::None;
+	JobCounter* pendingCounter = nullptr;
+	//Jobs GetJobOfCounter took off the own queue to get to the ones below, kept to not allocate on every wait.
+	std::vector<Job*> skippedJobs;
+};
+
+//Time a worker spent waiting for work, only measured with ELASTIC_WORKERS. Kept apart from WorkerState, as it is read by
+//whoever decides on the number of active workers.
+struct alignas(64) WorkerIdleTime
+{
+	std::atomic<unsigned long long> nanoseconds = 0;
+};
+
+//Longest path and total cost of the jobs of one frame, only computed with CRITICAL_PATH_SCHEDULING. Kept on its own
+//cache line, as all threads adding jobs of the frame write it.
+struct alignas(64) CriticalPath
+{
+	std::atomic<unsigned int> length = 0;
+	std::atomic<unsigned long long> totalCost = 0;
+};
+
+//Workers pinned to the CPUs of one NUMA node, only used with NUMA_AWARE.
+struct WorkerGroup
+{
+	WorkerGroup(int numaNode) : numaNode(numaNode) {}
+
+	//-1 if the node of the CPUs is unknown, in which case all workers are in this one group.
+	int numaNode;
+	std::vector<int> workers;
+	//Jobs hinted to this node by threads outside of it. Workers of the group take them before anything injected from
+	//outside of the system, workers of other nodes only once they did not find anything to steal on their own node.
+	InjectionQueue injectionQueue;
+};
 
 class JobSystem
 {
 
 public:
-	//How many jobs are still open
-	std::atomic<unsigned int> jobsToDo = 0;
 	JobSystem(std::atomic<bool>& isRunning, int desiredThreadCount);
+	~JobSystem();
 	//Stops the system and waits for all workers to join
 	void JoinJobs();
-	Job* CreateJob(JobFunction jobFunction);
+	//Number of worker threads, not counting threads outside of the system helping in WaitForCounter. With ELASTIC_WORKERS
+	//only the active ones are counted.
+	unsigned int GetWorkerCount();
+	//Creates a job running the given callable, which can be a plain JobFunction or a (move-only) lambda carrying its data.
+	//Callables that fit into JOB_PAYLOAD_SIZE are stored inside the job, bigger ones in the current frame arena and
+	//only if there is none (or it is full) on the heap.
+	template<typename Function>
+	Job* CreateJob(Function&& function, JobPriority priority = JobPriority::Normal);
+	//Callable stored in a job created by CreateJob from a callable of the given type. Only valid until the job is freed.
+	template<typename Callable>
+	static Callable& GetCallable(Job* job);
+	//Hands a finished job back to the pool or arena it was allocated from. Only needed for persistent jobs, which are
+	//not freed when they finish (see JobHandle.h).
+	void FreeJob(Job* job);
 	//Sets up the dependency connection between two jobs. Dependencies need to be set up before 
-	//adding jobs to the system using AddJob
+	//adding jobs to the system using AddJob (neither the dependent nor the dependency may be added yet).
+	//There is no limit to the number of dependents, dependents not fitting into the job spill into continuation chunks.
 	void AddDependency(Job* dependent, Job* dependency);
+	//Sets up a dependency on a job that may already be added, running or even finished, like the job of a previous frame.
+	//The dependent must not be added yet. The dependency has to stay valid memory though, which jobs allocated from a
+	//frame arena are until their frame ends. Returns false if the dependency was already finished, there is nothing to
+	//wait for then.
+	bool AddLateDependency(Job* dependent, Job* dependency);
 	//Adds a job to the system. From this point it will be worked at some point (if dependencies are met).
-	void AddJob(Job* job);
-	//Wait until all jobs are finished
-	void WaitForAllJobs();
+	//Jobs with unresolved dependencies are not put into any queue, the last dependency to finish pushes them instead.
+	//If a counter is given, it is incremented now and decremented once the job is finished.
+	void AddJob(Job* job, JobCounter* counter = nullptr);
+	//Adds a job to the system like AddJob, replacing the priority it was created with.
+	void AddJob(Job* job, JobPriority priority);
+	//Runs all jobs of a compiled graph, submitting its roots in one go. All jobs are attached to the counter if one is
+	//given. Must not be called again for the same graph before all of its jobs are finished.
+	void Run(JobGraph& graph, JobCounter* counter = nullptr);
+	//Hints that the job works on memory of the given NUMA node, so it is handed to the workers of that node instead of
+	//staying with the thread adding it. Must be called before the job is added. Only used with NUMA_AWARE, hints for
+	//nodes without workers are ignored.
+	void SetLocality(Job* job, int numaNode);
+	//Hints that the job works on the memory at the given address, see above.
+	void SetLocality(Job* job, const void* data);
+	//Sets the estimated cost of a job in microseconds, which is used by CRITICAL_PATH_SCHEDULING. Must be called before
+	//the job or any of its dependencies are added. If a cost key is given (like the function the job runs), the duration
+	//of jobs with that key is measured and learned, the estimate is only used until there is a measurement.
+	void SetCost(Job* job, unsigned int estimatedCost, const void* costKey = nullptr);
+	//Cost of the longest path through the jobs of the frame started last by BeginFrame, which is a lower bound for how
+	//long the frame takes. Jobs added by jobs of a frame belong to it as well. Only computed with CRITICAL_PATH_SCHEDULING.
+	unsigned int GetCriticalPathLength();
+	//Sum of the costs of all jobs of the frame started last. Only computed with CRITICAL_PATH_SCHEDULING.
+	unsigned long long GetTotalCost();
+	//Wait until all jobs attached to the counter are finished (or the system stopped running). The calling thread works
+	//jobs in the meantime and only blocks if there is nothing to work on. Can be called from inside a job. Without
+	//FIBER_JOBS the job stays on the stack, so it only works jobs attached to the counter (like the ones it just added)
+	//and the jobs they depend on that it finds in its own queue or the injection queue. It blocks otherwise, until other
+	//threads finished the rest.
+	void WaitForCounter(JobCounter& counter);
+	//Waits like WaitForCounter, but only blocks the calling thread without working any jobs. For threads outside of the
+	//system that have to leave all jobs to the workers, like benchmarks measuring how the workers share them.
+	void BlockForCounter(JobCounter& counter);
+	//Adds the job once all jobs attached to the counter are finished, right away if they already are. The waiter keeps
+	//the job in the list of the counter and has to stay valid until the job is added.
+	void AddJobAfterCounter(Job* job, JobCounter& counter, CounterWaiter& waiter);
+	//Attaches work that is not a job to the counter, like a coroutine suspended in between the jobs it runs in (see
+	//Task.h). Has to be matched by a call of ReleaseCounter once the work is done.
+	void AttachToCounter(JobCounter& counter);
+	//Releases one job or other work attached to the counter. Whoever brings it down to zero resumes everyone waiting.
+	void ReleaseCounter(JobCounter* counter);
+	//Runs body(i) for every i in [begin, end) and returns once all iterations are done, working on them in the meantime.
+	//Ranges are split lazily: a range only gets its upper half split off into a new job while the queue of the thread
+	//working on it is empty, so the splitting is driven by idle workers stealing those halves and there is never a job
+	//per iteration. In between grainSize iterations are run at once. A grainSize of 0 picks it from the measured cost of
+	//the iterations, aiming at chunks taking PARALLEL_FOR_CHUNK_DURATION_US. Can be called from inside a job, the split
+	//off jobs then get the priority of that job.
+	template<typename Body>
+	void ParallelFor(size_t begin, size_t end, const Body& body, size_t grainSize = 0);
+	//Starts a frame: until EndFrame is called, jobs created by the calling thread are allocated from the returned arena.
+	//Returns nullptr if all arenas are still used by other frames, jobs are then allocated from the job pools.
+	FrameArena* BeginFrame();
+	//Releases all jobs of a frame at once. Must only be called once all jobs of the frame are finished. With
+	//ELASTIC_WORKERS this is also where the number of active workers is adapted.
+	void EndFrame(FrameArena* arena);
 	//Thread local stored id of the worker thread.
 	__declspec(thread) static int thread_id;
+	//Thread local stored arena of the frame the thread is currently creating jobs for.
+	__declspec(thread) static FrameArena* current_arena;
+	//Thread local stored job the thread is currently executing, nullptr outside of jobs.
+	__declspec(thread) static Job* current_job;
+	//Thread local stored fiber the thread is running on, nullptr if it is not running on a fiber.
+	__declspec(thread) static JobFiber* current_fiber;
 private:
 
 	std::atomic<bool>& isRunning;
-	bool stopped = false;
-	int current_queue_index = 0;
-	std::condition_variable allJobsDoneConditionalVariable;
+	std::atomic<bool> stopped = false;
+	//Used to spread wake ups over the sleeping workers if PARK_ON_EVENT_COUNT is undefined.
+	std::atomic<unsigned int> wakeIndex = 0;
+	//Idle workers park here once spinning did not turn up any work.
+	EventCount idleWorkers;
+	//Threads in WaitForCounter park here. Notified whenever a counter reaches zero and whenever new work is pushed.
+	EventCount counterWaiters;
+	InjectionQueue injectionQueue;
 	std::vector<std::thread> workers;
 	std::vector<JobQueue*> queues;
-	std::mutex waitForAllJobMutex;
+	//One job pool per worker, indexed by thread_id.
+	std::vector<JobPool*> pools;
+	//One state per worker, indexed by thread_id.
+	std::vector<WorkerState*> workerStates;
+	//Workers with an id from this on are parked. Equals the number of workers without ELASTIC_WORKERS.
+	std::atomic<unsigned int> activeWorkerCount = 0;
+	//Workers that are not active park here until they are activated again.
+	EventCount parkedWorkers;
+	//One entry per worker, only with ELASTIC_WORKERS.
+	std::unique_ptr<WorkerIdleTime[]> idleTimes;
+	//Sum and number of the queue depths sampled since the number of active workers was last reconsidered
+	std::atomic<unsigned long long> queueDepthSum = 0;
+	std::atomic<unsigned long long> queueDepthSamples = 0;
+	//State of AdaptWorkerCount, guarded by elasticMutex.
+	struct ElasticState
+	{
+		unsigned int endedFrames = 0;
+		std::chrono::steady_clock::time_point intervalStart = std::chrono::steady_clock::now();
+		//Idle time of all workers together at the start of the interval
+		unsigned long long idleNanoseconds = 0;
+		//Average frame time of the previous interval in microseconds
+		long long frameTime = 0;
+		//Set if a worker was activated at the end of the previous interval
+		bool grew = false;
+		//Intervals left before another worker may be activated
+		unsigned int growHold = 0;
+		unsigned int changes = 0;
+	};
+	ElasticState elasticState;
+	std::mutex elasticMutex;
+	//All fibers of the pool and the ones not in use, only with FIBER_JOBS.
+	std::vector<JobFiber*> fibers;
+	JobFiber* freeFibers = nullptr;
+	std::mutex fiberPoolMutex;
+	//Suspended fibers whose counter reached zero, resumed by the next worker looking for work.
+	std::deque<JobFiber*> readyFibers;
+	std::mutex readyFibersMutex;
+	std::atomic<size_t> readyFiberCount = 0;
+	//One group per NUMA node the workers are pinned to, only with NUMA_AWARE.
+	std::vector<WorkerGroup*> workerGroups;
+	//Workers wait here until all of them allocated their queue and pool, before anyone tries to steal from them.
+	std::mutex startMutex;
+	std::condition_variable startCondition;
+	unsigned int startedWorkers = 0;
+	//Pool shared by all threads outside of the system. Allocating from it is guarded by the mutex.
+	JobPool externalPool;
+	std::mutex externalPoolMutex;
+	//Arenas are handed out in a round robin fashion, so consecutive frames use different ones.
+	std::vector<FrameArena*> frameArenas;
+	std::atomic<unsigned int> nextFrameArena = 0;
+	//How many jobs, callables and task frames did not fit into their frame arena anymore and came from the heap or the
+	//job pools instead. Collected from the arenas in EndFrame.
+	std::atomic<size_t> arenaOverflows = 0;
+	//Learned costs of the jobs with a cost key
+	CostTable costTable;
+	//Critical path of the frame of each frame arena, reset when the arena is handed out again. The last one is for the
+	//jobs added outside of frames, which is reset whenever BeginFrame finds no arena.
+	std::vector<CriticalPath> criticalPaths;
+	//Index of the arena handed out by the last BeginFrame, -1 if it found none.
+	std::atomic<int> latestFrame = -1;
+
+	//Shared by all jobs working on the ranges of one ParallelFor. Lives on the stack of the ParallelFor call, which does
+	//not return before all of them are finished.
+	template<typename Body>
+	struct ParallelForState
+	{
+		ParallelForState(const Body& body, size_t grainSize) : body(body), grainSize(grainSize), isAutoGrain(grainSize == 0) {}
+
+		const Body& body;
+		JobCounter counter;
+		//Iterations run between two checks for splitting. Adapted to the measured cost while running if isAutoGrain.
+		std::atomic<size_t> grainSize;
+		bool isAutoGrain;
+		//Time spent in and number of the iterations measured so far, only with isAutoGrain.
+		std::atomic<unsigned long long> measuredNanoseconds = 0;
+		std::atomic<unsigned long long> measuredIterations = 0;
+	};
+
+	//Dependents that became ready at the same time, they are collected so they can be pushed in a sensible order.
+	struct ReadyJobs
+	{
+		Job* jobs[MAX_INLINE_DEPENDENT_COUNT];
+		unsigned int count = 0;
+	};
 
 	void Worker(unsigned int id);
+	//Works, steals and waits for jobs until the system stops.
+	void WorkerLoop();
+#ifdef FIBER_JOBS
+	//Entry point of the fibers of the pool, which run the worker loop.
+	static void FiberMain(void* jobSystem);
+	//Takes a fiber from the pool, creating a new one if all of them are in use.
+	JobFiber* AcquireFiber();
+	JobFiber* CreateFiber();
+	//Switches the calling worker from its current fiber to the given one, which then takes care of the current one as
+	//the action says. Returns once the current fiber is resumed, which can be on another worker.
+	void SwitchFiber(JobFiber* fiber, FiberAction action, JobCounter* counter = nullptr);
+	//Called by a fiber right after it was switched to, restores its thread local state and carries out the pending action.
+	void CompleteSwitch();
+	//Switches to a fiber whose counter reached zero if there is one, putting the current fiber back into the pool.
+	bool ResumeReadyFiber();
+	void PushReadyFiber(JobFiber* fiber);
+#endif
+	//Guards the lists of waiters of a counter, see ReleaseCounter.
+	static void LockCounter(JobCounter* counter);
+	static void UnlockCounter(JobCounter* counter);
+	//Sets COUNTER_HAS_WAITERS before adding to the lists of the counter, which has to be locked. Returns false if all jobs
+	//of the counter are finished already, there is nothing to wait for then.
+	static bool MarkCounterWaited(JobCounter* counter);
+#ifdef PIN_WORKERS
+	//Picks a CPU for every worker from the topology of the machine and orders their steal victims by distance.
+	void PickWorkerCpus();
+#endif
+#ifdef ELASTIC_WORKERS
+	//Parks the calling worker until it is activated again, if it is not active and has nothing left in its own queue.
+	//Returns false if the worker should keep working instead.
+	bool ParkIfInactive(unsigned int id);
+	//Activates or parks one worker depending on the queue depth, idle time and frame time of the last interval.
+	void AdaptWorkerCount();
+	//Adds the current depth of all queues to the samples every ELASTIC_WORKERS_DEPTH_SAMPLE_INTERVAL pushes.
+	void SampleQueueDepth();
+#endif
+#ifdef NUMA_AWARE
+	//Allocates the queue, the pool and the state of the calling worker, which places them on the node it is pinned to.
+	void AllocateWorkerData(unsigned int id);
+	//Pushes a job to the worker group it is hinted to. Returns false if it has no hint or the calling worker is in the
+	//group anyway.
+	bool PushToLocalityGroup(Job* job);
+	//Takes a job hinted to another node, for when nothing could be stolen on the own node.
+	Job* StealFromOtherGroups(JobPriority priority);
+#endif
+	//Allocates a job from the current frame arena if there is one, otherwise from the job pool of the calling thread.
+	Job* AllocateJob();
+	//Allocates a continuation chunk from the current frame arena if there is one, otherwise from the heap.
+	DependentChunk* AllocateDependentChunk();
+	//Adds the dependent to the list of dependents of the dependency.
+	void AppendDependent(Job* dependency, Job* dependent);
+	//Type erased entry points for the callables stored in a job's payload
+	template<typename Callable>
+	static void InvokeInlinePayload(Job* job);
+	template<typename Callable>
+	static void DestroyInlinePayload(Job* job);
+	template<typename Callable>
+	static void InvokeExternalPayload(Job* job);
+	template<typename Callable>
+	static void DestroyArenaPayload(Job* job);
+	template<typename Callable>
+	static void DestroyHeapPayload(Job* job);
+	//Works on the range [begin, end) of a ParallelFor, splitting off the upper half whenever someone could steal it.
+	template<typename Body>
+	void RunParallelForRange(ParallelForState<Body>& state, size_t begin, size_t end);
+	//Runs the iterations [begin, end) of a ParallelFor, measuring them if the grain size is picked automatically.
+	template<typename Body>
+	void RunParallelForChunk(ParallelForState<Body>& state, size_t begin, size_t end);
+	//Checks if the calling thread has nothing queued up that others could steal, which is the case for threads outside
+	//of the system as long as the injection queue is empty.
+	bool IsOwnQueueEmpty();
 	bool TryToWorkJob();
 	void WaitForAvailableJobs();
+	//Checks if there is any work the calling worker could pick up.
+	bool HasAvailableWork();
+	//Lets a sleeping worker know new work is available.
+	void NotifyWorker();
 	JobQueue* GetQueue();
+	//Gets the pool of the calling worker or nullptr if called from outside of the system.
+	JobPool* GetPool();
+	//Gets a job for a thread waiting in WaitForCounter, which can be a worker or a thread outside of the system.
+	Job* GetJobToHelp();
+	//Gets a job needed by the counter (see IsJobNeededByCounter) from the own queue or the injection queues, for a job
+	//waiting in WaitForCounter.
+	Job* GetJobOfCounter(JobCounter& counter);
+	//Gets the job with the highest priority from the own queue or the injection queue.
 	Job* GetJob();
-	void StealJob();
-	bool CanExecuteJob(Job* job);
+	Job* GetJob(JobPriority priority);
+	//Tries to steal jobs from the other workers' queues. Returns one of them to be worked right away, the rest is pushed
+	//onto our own queue. Returns nullptr if there was nothing to steal.
+	Job* StealJob();
+	Job* StealJob(JobPriority priority);
+	//Steals up to half of the jobs of the given priority from the public end of the given worker's queue, updating the
+	//steal counters.
+	Job* StealFrom(int victim, JobPriority priority);
+	//Returns the next number of the calling worker's xorshift random number generator.
+	unsigned int NextRandom();
+	//Pushes a job without unresolved dependencies. Called from a worker the job is pushed onto the workers own
+	//queue, otherwise it goes into the injection queue.
+	void PushReadyJob(Job* job);
+	//Pushes multiple jobs without unresolved dependencies at once.
+	void PushReadyJobs(Job* const* jobs, unsigned int count);
+	//Resolves one dependency of a job whose dependency finished, collecting it once it has none left.
+	void ReleaseDependent(Job* dependent, ReadyJobs& readyJobs);
+	//Pushes all collected jobs. With CRITICAL_PATH_SCHEDULING the job on the longest path is pushed last, so it is the
+	//first one popped by the owner, while thieves take the others from the public end.
+	void PushReadyJobs(ReadyJobs& readyJobs);
+	//Computes the longest path from the job to the end of its graph. Paths already computed are not walked again.
+	unsigned int ComputePathLength(Job* job);
+	//Maps a job's path length to the lane it goes to, relative to the critical path of the frame of the job.
+	JobPriority GetPathPriority(Job* job);
+	//Frame of the jobs added by the calling thread: the one of its frame arena, otherwise the one of the job it runs.
+	signed char GetCurrentFrame();
+	//Critical path of the given frame, the one of the jobs outside of frames for -1.
+	CriticalPath& GetCriticalPath(int frame);
+	//Extends the critical path of the frame by a path of the given length and adds the cost to its total.
+	void AddToCriticalPath(int frame, unsigned int pathLength, unsigned long long cost);
 	void Execute(Job* job);
 	void Finish(Job* job);
 	void WakeAll();
 };
 
+template<typename Function>
+Job* JobSystem::CreateJob(Function&& function, JobPriority priority)
+{
+	typedef typename std::decay<Function>::type Callable;
+	Job* job = AllocateJob();
+	job->priority = priority;
+	if constexpr (sizeof(Callable) <= JOB_PAYLOAD_SIZE && alignof(Callable) <= JOB_PAYLOAD_ALIGNMENT)
+	{
+		//Small callables like function pointers or lambdas with a few captures live right inside the job.
+		new (job->payload) Callable(std::forward<Function>(function));
+		job->invoke = &InvokeInlinePayload<Callable>;
+		job->destroy = std::is_trivially_destructible<Callable>::value ? nullptr : &DestroyInlinePayload<Callable>;
+	}
+	else
+	{
+		Callable** callable = reinterpret_cast<Callable**>(job->payload);
+		void* memory = current_arena ? current_arena->Allocate(sizeof(Callable), alignof(Callable)) : nullptr;
+		if (memory)
+		{
+			//The arena memory is released with the frame, so only the callable itself has to be destroyed.
+			*callable = new (memory) Callable(std::forward<Function>(function));
+			job->destroy = std::is_trivially_destructible<Callable>::value ? nullptr : &DestroyArenaPayload<Callable>;
+		}
+		else
+		{
+			*callable = new Callable(std::forward<Function>(function));
+			job->destroy = &DestroyHeapPayload<Callable>;
+		}
+		job->invoke = &InvokeExternalPayload<Callable>;
+	}
+	return job;
+}
+
+template<typename Callable>
+Callable& JobSystem::GetCallable(Job* job)
+{
+	//Same decision as in CreateJob.
+	if constexpr (sizeof(Callable) <= JOB_PAYLOAD_SIZE && alignof(Callable) <= JOB_PAYLOAD_ALIGNMENT)
+	{
+		return *std::launder(reinterpret_cast<Callable*>(job->payload));
+	}
+	else
+	{
+		return **reinterpret_cast<Callable**>(job->payload);
+	}
+}
+
+template<typename Callable>
+void JobSystem::InvokeInlinePayload(Job* job)
+{
+	(*std::launder(reinterpret_cast<Callable*>(job->payload)))();
+}
+
+template<typename Callable>
+void JobSystem::DestroyInlinePayload(Job* job)
+{
+	std::launder(reinterpret_cast<Callable*>(job->payload))->~Callable();
+}
+
+template<typename Callable>
+void JobSystem::InvokeExternalPayload(Job* job)
+{
+	(**reinterpret_cast<Callable**>(job->payload))();
+}
+
+template<typename Callable>
+void JobSystem::DestroyArenaPayload(Job* job)
+{
+	(*reinterpret_cast<Callable**>(job->payload))->~Callable();
+}
+
+template<typename Callable>
+void JobSystem::DestroyHeapPayload(Job* job)
+{
+	delete *reinterpret_cast<Callable**>(job->payload);
+}
+
+template<typename Body>
+void JobSystem::ParallelFor(size_t begin, size_t end, const Body& body, size_t grainSize)
+{
+	if (begin >= end)
+	{
+		return;
+	}
+	//Every body type has its own key, so the cost per iteration learned in one call is used in the next one. The cost
+	//table stores it in nanoseconds instead of the microseconds used for jobs.
+	static const char iterationCostKey = 0;
+	ParallelForState<Body> state(body, grainSize);
+	if (state.isAutoGrain)
+	{
+		unsigned int iterationCost = costTable.Get(&iterationCostKey, 0);
+		//Without a measurement single iterations are run until the first chunks are measured.
+		grainSize = iterationCost ? PARALLEL_FOR_CHUNK_DURATION_US * 1000ull / iterationCost : 1;
+		state.grainSize.store(std::max<size_t>(grainSize, 1), std::memory_order_relaxed);
+	}
+	RunParallelForRange(state, begin, end);
+	WaitForCounter(state.counter);
+	unsigned long long measuredIterations = state.measuredIterations.load(std::memory_order_relaxed);
+	if (measuredIterations > 0)
+	{
+		costTable.Record(&iterationCostKey, static_cast<unsigned int>(state.measuredNanoseconds.load(std::memory_order_relaxed) / measuredIterations));
+	}
+}
+
+template<typename Body>
+void JobSystem::RunParallelForRange(ParallelForState<Body>& state, size_t begin, size_t end)
+{
+	size_t grainSize = state.grainSize.load(std::memory_order_relaxed);
+	while (end - begin > grainSize)
+	{
+		if (IsOwnQueueEmpty())
+		{
+			//Nothing left for thieves to take, so give them the upper half. The lower half stays with us, so we keep
+			//working on the data that is already in our cache.
+			size_t middle = begin + (end - begin) / 2;
+			ParallelForState<Body>* sharedState = &state;
+			Job* job = CreateJob([this, sharedState, middle, end]() { RunParallelForRange(*sharedState, middle, end); },
+				current_job ? current_job->priority : JobPriority::Normal);
+			//The split off half is on the same path as the range it was split from.
+			job->pathLength = current_job ? current_job->pathLength : 0;
+			AddJob(job, &state.counter);
+			end = middle;
+			continue;
+		}
+		RunParallelForChunk(state, begin, begin + grainSize);
+		begin += grainSize;
+		grainSize = state.grainSize.load(std::memory_order_relaxed);
+	}
+	RunParallelForChunk(state, begin, end);
+}
+
+template<typename Body>
+void JobSystem::RunParallelForChunk(ParallelForState<Body>& state, size_t begin, size_t end)
+{
+	if (!state.isAutoGrain)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			state.body(i);
+		}
+		return;
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = begin; i < end; ++i)
+	{
+		state.body(i);
+	}
+	unsigned long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	unsigned long long measuredNanoseconds = state.measuredNanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed) + nanoseconds;
+	unsigned long long measuredIterations = state.measuredIterations.fetch_add(end - begin, std::memory_order_relaxed) + (end - begin);
+	//Size the next chunks by the average cost of all iterations measured so far.
+	size_t grainSize = static_cast<size_t>(measuredIterations * PARALLEL_FOR_CHUNK_DURATION_US * 1000ull / std::max(measuredNanoseconds, 1ull));
+	state.grainSize.store(std::max<size_t>(grainSize, 1), std::memory_order_relaxed);
+}
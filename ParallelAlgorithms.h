@@ -0,0 +1,244 @@
+#pragma once
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <utility>
+#include <vector>
+#include "JobSystem.h"
+#include "Settings.h"
+
+//Parallel versions of common algorithms built on JobSystem::ParallelFor. The input is cut into blocks, which are spread
+//over the workers by the lazy splitting of ParallelFor, so idle workers steal whole blocks. All of them return once the
+//result is complete and work on it in the meantime, so they can be called from inside a job as well. Inputs with fewer
+//than PARALLEL_ALGORITHMS_MIN_BLOCK_SIZE elements are run serially.
+
+//Number of elements per block for an input of the given size. There are PARALLEL_ALGORITHMS_BLOCKS_PER_THREAD blocks per
+//thread (the calling thread works as well), so stealing can even out differences between the blocks.
+inline size_t GetParallelBlockSize(JobSystem& jobsystem, size_t count)
+{
+	size_t blockCount = (jobsystem.GetWorkerCount() + 1) * PARALLEL_ALGORITHMS_BLOCKS_PER_THREAD;
+	return std::max<size_t>((count + blockCount - 1) / blockCount, PARALLEL_ALGORITHMS_MIN_BLOCK_SIZE);
+}
+
+//Partial results of the blocks. Each one has its own cache line, as they are written by different workers.
+template<typename T>
+struct alignas(64) ParallelPartial
+{
+	T value;
+};
+
+//Combines map(i) of every i in [begin, end) using combine, starting from identity. combine has to be associative and
+//identity has to be neutral to it. The blocks are combined in the order of their indices, so combine does not have to
+//be commutative.
+template<typename T, typename Map, typename Combine>
+T ParallelReduce(JobSystem& jobsystem, size_t begin, size_t end, T identity, const Map& map, const Combine& combine)
+{
+	if (begin >= end)
+	{
+		return identity;
+	}
+	size_t blockSize = GetParallelBlockSize(jobsystem, end - begin);
+	size_t blockCount = (end - begin + blockSize - 1) / blockSize;
+	std::vector<ParallelPartial<T>> partials(blockCount, ParallelPartial<T>{ identity });
+	jobsystem.ParallelFor(0, blockCount, [&](size_t block)
+		{
+			size_t blockBegin = begin + block * blockSize;
+			size_t blockEnd = std::min(blockBegin + blockSize, end);
+			T value = identity;
+			for (size_t i = blockBegin; i < blockEnd; ++i)
+			{
+				value = combine(value, map(i));
+			}
+			partials[block].value = value;
+		}, 1);
+	T result = identity;
+	for (const ParallelPartial<T>& partial : partials)
+	{
+		result = combine(result, partial.value);
+	}
+	return result;
+}
+
+//Writes the prefix sums of [first, last) to output like std::inclusive_scan: output[i] is the combination of all inputs
+//up to and including i. op has to be associative. output can be first to scan in place.
+template<typename InputIterator, typename OutputIterator, typename BinaryOp>
+void ParallelInclusiveScan(JobSystem& jobsystem, InputIterator first, InputIterator last, OutputIterator output, BinaryOp op)
+{
+	typedef typename std::iterator_traits<InputIterator>::value_type T;
+	size_t count = static_cast<size_t>(last - first);
+	if (count == 0)
+	{
+		return;
+	}
+	size_t blockSize = GetParallelBlockSize(jobsystem, count);
+	size_t blockCount = (count + blockSize - 1) / blockSize;
+	if (blockCount == 1)
+	{
+		std::inclusive_scan(first, last, output, op);
+		return;
+	}
+	//First every block is reduced on its own, the sums of the blocks before a block are then the offset its scan
+	//starts from. The last block is never needed as an offset, so it is left out.
+	std::vector<ParallelPartial<T>> offsets(blockCount - 1);
+	jobsystem.ParallelFor(0, blockCount - 1, [&](size_t block)
+		{
+			InputIterator blockBegin = first + block * blockSize;
+			T sum = *blockBegin;
+			for (InputIterator it = blockBegin + 1; it != blockBegin + blockSize; ++it)
+			{
+				sum = op(sum, *it);
+			}
+			offsets[block].value = sum;
+		}, 1);
+	for (size_t block = 1; block < blockCount - 1; ++block)
+	{
+		offsets[block].value = op(offsets[block - 1].value, offsets[block].value);
+	}
+	jobsystem.ParallelFor(0, blockCount, [&](size_t block)
+		{
+			size_t blockBegin = block * blockSize;
+			size_t blockEnd = std::min(blockBegin + blockSize, count);
+			if (block == 0)
+			{
+				std::inclusive_scan(first, first + blockEnd, output, op);
+			}
+			else
+			{
+				std::inclusive_scan(first + blockBegin, first + blockEnd, output + blockBegin, op, offsets[block - 1].value);
+			}
+		}, 1);
+}
+
+//Writes the prefix sums of [first, last) to output like std::exclusive_scan: output[i] is the combination of init and
+//all inputs before i. op has to be associative. output can be first to scan in place.
+template<typename InputIterator, typename OutputIterator, typename T, typename BinaryOp>
+void ParallelExclusiveScan(JobSystem& jobsystem, InputIterator first, InputIterator last, OutputIterator output, T init, BinaryOp op)
+{
+	size_t count = static_cast<size_t>(last - first);
+	if (count == 0)
+	{
+		return;
+	}
+	size_t blockSize = GetParallelBlockSize(jobsystem, count);
+	size_t blockCount = (count + blockSize - 1) / blockSize;
+	if (blockCount == 1)
+	{
+		std::exclusive_scan(first, last, output, init, op);
+		return;
+	}
+	//Same as the inclusive scan, except that every offset starts with init, which makes the first block regular.
+	std::vector<ParallelPartial<T>> offsets(blockCount);
+	jobsystem.ParallelFor(0, blockCount - 1, [&](size_t block)
+		{
+			InputIterator blockBegin = first + block * blockSize;
+			T sum = *blockBegin;
+			for (InputIterator it = blockBegin + 1; it != blockBegin + blockSize; ++it)
+			{
+				sum = op(sum, *it);
+			}
+			offsets[block + 1].value = sum;
+		}, 1);
+	offsets[0].value = init;
+	for (size_t block = 1; block < blockCount; ++block)
+	{
+		offsets[block].value = op(offsets[block - 1].value, offsets[block].value);
+	}
+	jobsystem.ParallelFor(0, blockCount, [&](size_t block)
+		{
+			size_t blockBegin = block * blockSize;
+			size_t blockEnd = std::min(blockBegin + blockSize, count);
+			std::exclusive_scan(first + blockBegin, first + blockEnd, output + blockBegin, offsets[block].value, op);
+		}, 1);
+}
+
+//Number of elements the first d elements of merging a and b take from a, if the merge takes from a first for equal
+//elements like std::merge. Found by a binary search over the diagonal d of the merge path.
+template<typename Iterator, typename Compare>
+size_t FindMergeSplit(Iterator a, size_t aCount, Iterator b, size_t bCount, size_t d, Compare comp)
+{
+	size_t low = d > bCount ? d - bCount : 0;
+	size_t high = std::min(d, aCount);
+	while (low < high)
+	{
+		size_t i = low + (high - low) / 2;
+		//Taking i elements from a is too few if a[i] would still be merged before b[d - i - 1].
+		if (!comp(b[d - i - 1], a[i]))
+		{
+			low = i + 1;
+		}
+		else
+		{
+			high = i;
+		}
+	}
+	return low;
+}
+
+//Sorts [first, last) like std::stable_sort. Blocks are sorted in parallel and then merged pairwise until one run is
+//left. The output of every merge round is cut into blocks as well, which find their part of the two runs with a binary
+//search, so even the last merge of two halves runs on all workers. Needs a buffer as big as the input.
+template<typename Iterator, typename Compare>
+void ParallelSort(JobSystem& jobsystem, Iterator first, Iterator last, Compare comp)
+{
+	typedef typename std::iterator_traits<Iterator>::value_type T;
+	size_t count = static_cast<size_t>(last - first);
+	size_t blockSize = GetParallelBlockSize(jobsystem, count);
+	size_t blockCount = (count + blockSize - 1) / blockSize;
+	if (blockCount <= 1)
+	{
+		std::stable_sort(first, last, comp);
+		return;
+	}
+	jobsystem.ParallelFor(0, blockCount, [&](size_t block)
+		{
+			size_t blockBegin = block * blockSize;
+			std::stable_sort(first + blockBegin, first + std::min(blockBegin + blockSize, count), comp);
+		}, 1);
+
+	std::vector<T> buffer(count);
+	//Runs are merged back and forth between the input and the buffer.
+	bool isInBuffer = false;
+	for (size_t runSize = blockSize; runSize < count; runSize *= 2)
+	{
+		//Merged runs are a multiple of blockSize long, so every output block lies within one of them.
+		auto merge = [&, runSize](auto source, auto destination)
+			{
+				jobsystem.ParallelFor(0, blockCount, [&, runSize](size_t block)
+					{
+						size_t outputBegin = block * blockSize;
+						size_t outputEnd = std::min(outputBegin + blockSize, count);
+						size_t runBegin = outputBegin / (2 * runSize) * (2 * runSize);
+						size_t middle = std::min(runBegin + runSize, count);
+						size_t runEnd = std::min(runBegin + 2 * runSize, count);
+						size_t aBegin = FindMergeSplit(source + runBegin, middle - runBegin, source + middle, runEnd - middle, outputBegin - runBegin, comp);
+						size_t aEnd = FindMergeSplit(source + runBegin, middle - runBegin, source + middle, runEnd - middle, outputEnd - runBegin, comp);
+						std::merge(std::make_move_iterator(source + runBegin + aBegin), std::make_move_iterator(source + runBegin + aEnd),
+							std::make_move_iterator(source + middle + (outputBegin - runBegin - aBegin)), std::make_move_iterator(source + middle + (outputEnd - runBegin - aEnd)),
+							destination + outputBegin, comp);
+					}, 1);
+			};
+		if (isInBuffer)
+		{
+			merge(buffer.begin(), first);
+		}
+		else
+		{
+			merge(first, buffer.begin());
+		}
+		isInBuffer = !isInBuffer;
+	}
+	if (isInBuffer)
+	{
+		jobsystem.ParallelFor(0, blockCount, [&](size_t block)
+			{
+				size_t blockBegin = block * blockSize;
+				std::move(buffer.begin() + blockBegin, buffer.begin() + std::min(blockBegin + blockSize, count), first + blockBegin);
+			}, 1);
+	}
+}
+
+template<typename Iterator>
+void ParallelSort(JobSystem& jobsystem, Iterator first, Iterator last)
+{
+	ParallelSort(jobsystem, first, last, std::less<typename std::iterator_traits<Iterator>::value_type>());
+}
@@ -8,9 +8,137 @@ constexpr bool isRunningParallel = true;
 //Controls how many frames are run at the same time. Useful for stress testing.
 #define SIMULATENOUS_FRAME_COUNT 1
 
+//Controls wether frames are pipelined instead of waiting for each frame to finish before starting the next one. Up to
+//FRAMES_IN_FLIGHT frames overlap, only their rendering jobs are chained so frames are still rendered in order.
+//#define PIPELINED_FRAMES
+
+//Controls how many frames can be in flight at the same time when PIPELINED_FRAMES is defined.
+#define FRAMES_IN_FLIGHT 2
+
+//Controls over how many frames the throughput and latency of pipelined frames are averaged before they get reported.
+#define PIPELINE_REPORT_INTERVAL 100
+
+//Controls how many frame arenas are cycled through. Every frame that is in flight at the same time needs its own arena,
+//otherwise its jobs fall back to the job pools.
+#define FRAME_ARENA_MIN_COUNT (SIMULATENOUS_FRAME_COUNT > FRAMES_IN_FLIGHT ? SIMULATENOUS_FRAME_COUNT : FRAMES_IN_FLIGHT)
+#define FRAME_ARENA_COUNT (FRAME_ARENA_MIN_COUNT > 3 ? FRAME_ARENA_MIN_COUNT : 3)
+
+//Controls how many bytes each frame arena can hand out. Jobs that do not fit anymore are allocated from the job pools,
+//callables and task frames from the heap.
+#define FRAME_ARENA_SIZE (1024 * 1024)
+
+//Controls wether UpdateParallel records its jobs into a JobGraph once and replays it every frame, instead of creating
+//and wiring up all jobs again every frame.
+//#define REPLAY_JOB_GRAPH
+
 //Controls how many particle jobs are spawned for each frame. Useful for stress testing.
 #define PARTICLE_JOB_COUNT 1
 
+//Controls how many microseconds the chunks of iterations a ParallelFor runs between checks for splitting should take,
+//when the grain size is picked automatically.
+#define PARALLEL_FOR_CHUNK_DURATION_US 20
+
+//Controls the minimum number of elements per block the parallel algorithms (see ParallelAlgorithms.h) cut their input
+//into. Smaller inputs are not worth spreading over the workers.
+#define PARALLEL_ALGORITHMS_MIN_BLOCK_SIZE 4096
+
+//Controls into how many blocks per thread the parallel algorithms cut big inputs.
+#define PARALLEL_ALGORITHMS_BLOCKS_PER_THREAD 4
+
+//Controls wether the particles are updated by a single job running a ParallelFor over PARTICLE_JOB_COUNT particle
+//updates, instead of creating a job for each of them. Not used when REPLAY_JOB_GRAPH is defined.
+//#define PARALLEL_FOR_PARTICLES
+
+//Controls wether the job queues use the lock-free Chase-Lev work-stealing deque. If undefined the mutex guarded std::deque
+//is used instead, which makes it easy to A/B both implementations against each other.
+#define LOCK_FREE_QUEUE
+
+//Controls how many jobs a job pool allocates at once when it runs out of recycled jobs.
+#define JOB_POOL_BLOCK_SIZE 64
+
+//Controls wether idle workers spin, then yield and finally park on a futex based event count shared by all workers.
+//If undefined every worker sleeps on the condition variable of its own queue instead.
+#define PARK_ON_EVENT_COUNT
+
+//Controls how often an idle worker looks for work, with a pause instruction in between, before it starts yielding.
+#define IDLE_SPIN_COUNT 1000
+
+//Controls how often an idle worker yields its time slice while looking for work before it parks.
+#define IDLE_YIELD_COUNT 16
+
+//Controls how often workers prefer higher priorities over lower ones. Every PRIORITY_STARVATION_LIMIT-th job a worker
+//takes from its own and the injection queue comes from the lowest priority that has work, so a steady stream of high
+//priority jobs can not starve the others. If undefined, priorities are strictly followed.
+#define PRIORITY_STARVATION_LIMIT 16
+
+//Controls wether ready jobs are scheduled by the length of the longest path from them to the end of their graph, which is
+//computed from the job costs (see JobSystem::SetCost) when jobs are added. Jobs on or close to the critical path go to
+//the high priority lanes, the priorities given to CreateJob and AddJob are ignored.
+//#define CRITICAL_PATH_SCHEDULING
+
+//Controls wether the critical path of the frames gets reported next to the measured frame time, averaged over
+//CRITICAL_PATH_REPORT_INTERVAL frames. Only works with CRITICAL_PATH_SCHEDULING.
+//#define REPORT_CRITICAL_PATH
+#define CRITICAL_PATH_REPORT_INTERVAL 100
+
+//Controls how many different cost keys can be learned.
+#define COST_TABLE_SIZE 256
+
+//Controls the maximum number of jobs a thief takes from its victim at once. Thieves take up to half of the victim's jobs,
+//so deep queues get rebalanced with a few steals instead of one steal per job. 1 steals single jobs.
+#define STEAL_BATCH_SIZE 32
+
+//Controls wether a thief first tries the victim it successfully stole from last time, before sweeping over all others.
+#define STEAL_VICTIM_AFFINITY
+
+//Controls wether workers are pinned to CPUs picked from the topology of the machine (see CpuTopology.h). Thieves then
+//try the workers on the same core first, then those sharing a cache and only then the remote ones.
+//#define PIN_WORKERS
+
+//Controls wether workers are grouped by NUMA node. Every worker allocates its queue and job pool itself once it is pinned,
+//so they end up on its node. Jobs with a locality hint (see JobSystem::SetLocality) are handed to the workers of their
+//node and thieves only go to other nodes once there is nothing left to steal on their own one. Pins the workers.
+//#define NUMA_AWARE
+#ifdef NUMA_AWARE
+#define PIN_WORKERS
+#endif
+
+//Controls wether the number of active workers adapts to the load at runtime. Every hardware thread gets a worker, but
+//only as many as picked above start out active, the others are parked without using any CPU time. Every
+//ELASTIC_WORKERS_INTERVAL frames EndFrame looks at the depth of the queues, the idle time of the workers and the frame
+//time to activate or park one worker. Every change is reported.
+//#define ELASTIC_WORKERS
+
+//Controls after how many ended frames the number of active workers is reconsidered.
+#define ELASTIC_WORKERS_INTERVAL 30
+
+//Controls how many jobs per active worker have to be queued on average for another worker to be activated.
+#define ELASTIC_WORKERS_GROW_QUEUE_DEPTH 4
+
+//Controls how much of their time in percent the active workers have to spend waiting for work for one to be parked.
+#define ELASTIC_WORKERS_SHRINK_IDLE_PERCENT 50
+
+//Controls by how many percent the frame time has to go down after activating a worker, otherwise it is parked again.
+#define ELASTIC_WORKERS_MIN_GAIN_PERCENT 2
+
+//Controls for how many intervals no worker is activated after one had to be parked again for not making frames faster.
+#define ELASTIC_WORKERS_HOLD_INTERVALS 10
+
+//Controls after how many pushed jobs a worker samples the depth of all queues.
+#define ELASTIC_WORKERS_DEPTH_SAMPLE_INTERVAL 64
+
+//Controls wether jobs run on fibers (see Fiber.h). A job waiting for a counter then suspends its fiber and the worker goes
+//on with another fiber from the pool, instead of working other jobs on top of the waiting one. Once the counter reaches
+//zero the suspended fiber is resumed by whichever worker is free. Threads outside of the system keep working jobs while
+//waiting. With MSVC fiber safe optimizations (/GT) have to be enabled, as a job can continue on another thread.
+//#define FIBER_JOBS
+
+//Controls how many bytes of stack each fiber gets.
+#define FIBER_STACK_SIZE (256 * 1024)
+
+//Controls how many fibers are created up front. Further ones are created whenever all of them are in use.
+#define FIBER_POOL_SIZE 64
+
 //Controls wether verbose information should be printed.
 //#define VERBOSE
 
@@ -26,6 +154,98 @@ constexpr bool isRunningParallel = true;
 //Controls wether average frame duration should be measured before the normal behaviour starts.
 //#define MEASURING_AVERAGE_TIME
 
+//Controls wether the sleep and wake up protocol of the workers gets stress tested before the normal behaviour starts.
+//#define WAKE_UP_STRESS_TEST
+
+//Controls wether jobs waiting for other jobs from inside a job get stress tested before the normal behaviour starts.
+//#define NESTED_WAIT_STRESS_TEST
+
+//Controls wether stealing gets benchmarked with lots of small particle jobs before the normal behaviour starts.
+//#define STEAL_BENCHMARK
+
+//Controls how many particle jobs are spawned each frame of the steal benchmark.
+#define STEAL_BENCHMARK_PARTICLE_JOB_COUNT 4000
+
+//Controls how many microseconds each particle job of the steal benchmark takes.
+#define STEAL_BENCHMARK_JOB_DURATION_US 5
+
+//Controls how many frames the steal benchmark runs.
+#define STEAL_BENCHMARK_FRAME_COUNT 200
+
+//Controls wether stealing of jobs working on data their parent just wrote gets benchmarked before the normal behaviour
+//starts. Compare runs with and without PIN_WORKERS.
+//#define TOPOLOGY_BENCHMARK
+
+//Controls how many child jobs are spawned each frame of the topology benchmark.
+#define TOPOLOGY_BENCHMARK_CHILD_COUNT 256
+
+//Controls how many bytes of its parent's data each child job of the topology benchmark reads.
+#define TOPOLOGY_BENCHMARK_CHUNK_SIZE 16384
+
+//Controls how many frames the topology benchmark runs.
+#define TOPOLOGY_BENCHMARK_FRAME_COUNT 200
+
+//Controls wether ParallelFor gets benchmarked against a serial loop before the normal behaviour starts.
+//#define PARALLEL_FOR_BENCHMARK
+
+//Controls up to how many iterations the ParallelFor benchmark runs, starting at 1000 and growing tenfold.
+#define PARALLEL_FOR_BENCHMARK_MAX_ITERATIONS 10000000
+
+//Controls the grain size the ParallelFor benchmark compares the automatically picked grain size with.
+#define PARALLEL_FOR_BENCHMARK_GRAIN_SIZE 1024
+
+//Controls how often each measurement of the ParallelFor benchmark is repeated.
+#define PARALLEL_FOR_BENCHMARK_REPETITIONS 10
+
+//Controls wether the parallel algorithms get benchmarked against the serial std algorithms before the normal behaviour
+//starts.
+//#define PARALLEL_ALGORITHMS_BENCHMARK
+
+//Controls up to how many elements the parallel algorithms benchmark runs, starting at 1000 and growing tenfold.
+#define PARALLEL_ALGORITHMS_BENCHMARK_MAX_SIZE 100000000
+
+//Controls how often each measurement of the parallel algorithms benchmark is repeated.
+#define PARALLEL_ALGORITHMS_BENCHMARK_REPETITIONS 5
+
+//Controls wether a tree of coroutine tasks (see Task.h) gets benchmarked against the same tree of jobs waiting for their
+//children with WaitForCounter before the normal behaviour starts.
+//#define TASK_BENCHMARK
+
+//Controls how many levels the trees of the task benchmark have. Every level doubles the number of leaves. The frames of
+//the tasks come from a frame arena, a tree takes about 900 bytes per node of it, so keep it within FRAME_ARENA_SIZE.
+#define TASK_BENCHMARK_DEPTH 8
+
+//Controls how many random numbers each leaf of the task benchmark generates.
+#define TASK_BENCHMARK_LEAF_ITERATIONS 1000
+
+//Controls how many scheduled leaves of the task benchmark race each other in a WhenAny after the trees.
+#define TASK_BENCHMARK_RACE_LEAF_COUNT 8
+
+//Controls how often each tree of the task benchmark is run.
+#define TASK_BENCHMARK_REPETITIONS 20
+
+//Controls wether chains of jobs passing their results with JobHandle::Then get benchmarked against the same chains of
+//plain jobs before the normal behaviour starts.
+//#define JOB_HANDLE_BENCHMARK
+
+//Controls how many chains the job handle benchmark runs at once.
+#define JOB_HANDLE_BENCHMARK_CHAIN_COUNT 1000
+
+//Controls how often the chains of the job handle benchmark are run.
+#define JOB_HANDLE_BENCHMARK_REPETITIONS 20
+
+//Controls how many submit and wait cycles the wake up stress test runs.
+#define WAKE_UP_STRESS_CYCLES 1000000
+
+//Controls after how many milliseconds without a finished cycle the wake up stress test counts the system as stalled.
+#define WAKE_UP_STRESS_DEADLINE_MS 500
+
+//Controls how many cycles of waiting parent jobs the nested wait stress test runs for each number of workers.
+#define NESTED_WAIT_STRESS_CYCLES 100000
+
+//Controls after how many milliseconds without a finished cycle the nested wait stress test counts the system as stalled.
+#define NESTED_WAIT_STRESS_DEADLINE_MS 1000
+
 
 #ifdef VERBOSE
 #define PRINT(x) printf(x)
@@ -0,0 +1,530 @@
+#pragma once
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "JobSystem.h"
+#include "Settings.h"
+
+//Task<T> is a coroutine running on the workers of a JobSystem. Tasks are lazy, they only start once they are awaited by
+//another task or started on their own with Task::Start (or WaitForTask from outside of the system). Inside a task
+//co_await suspends it without blocking the worker:
+//	co_await counter;                 resumes once all jobs attached to the JobCounter are finished
+//	co_await job;                     resumes once the Job is finished, see JobSystem::AddLateDependency
+//	co_await task;                    runs the Task right away and resumes with its result once it completed
+//	co_await Schedule(jobsystem);     resumes in a new job, so another worker can pick up the rest of the task
+//A task suspended on a counter or a job is resumed by a new job, so it continues on whichever worker takes that job.
+//Awaiting a task and completing one transfer control symmetrically, so chains of tasks run on the same worker without
+//growing its stack. Tasks can not throw, like jobs.
+//Frames of tasks created while a frame arena is current (see JobSystem::BeginFrame) are allocated from it, and the arena
+//stays current while the task runs, so the tasks and jobs it creates come from the arena as well no matter which worker
+//resumes it. Such tasks have to complete and be destroyed before their frame ends.
+
+template<typename T>
+class Task;
+
+//Task frames are resumed by different workers, so each one starts on its own cache line.
+#define TASK_FRAME_ALIGNMENT 64
+
+//Allocates a task frame from the current frame arena if there is one, otherwise from the heap. The byte behind the
+//frame records which one it was, as only heap frames have to be deleted.
+inline void* AllocateTaskFrame(size_t size)
+{
+	FrameArena* arena = JobSystem::current_arena;
+	unsigned char* frame = arena ? static_cast<unsigned char*>(arena->Allocate(size + 1, TASK_FRAME_ALIGNMENT)) : nullptr;
+	if (frame)
+	{
+		frame[size] = 1;
+		return frame;
+	}
+	frame = static_cast<unsigned char*>(::operator new(size + 1, std::align_val_t(TASK_FRAME_ALIGNMENT)));
+	frame[size] = 0;
+	return frame;
+}
+
+inline void FreeTaskFrame(void* frame, size_t size)
+{
+	//Arena frames are released with their frame.
+	if (!static_cast<unsigned char*>(frame)[size])
+	{
+		::operator delete(frame, std::align_val_t(TASK_FRAME_ALIGNMENT));
+	}
+}
+
+//Priority of the jobs resuming a task, which keeps the priority of the job it was suspended in.
+inline JobPriority GetTaskPriority()
+{
+	return JobSystem::current_job ? JobSystem::current_job->priority : JobPriority::Normal;
+}
+
+//Creates a job resuming the suspended coroutine with the given frame arena being current.
+inline Job* CreateResumeJob(JobSystem& jobsystem, std::coroutine_handle<> handle, FrameArena* arena, JobPriority priority)
+{
+	return jobsystem.CreateJob([handle, arena]()
+		{
+			FrameArena* outerArena = JobSystem::current_arena;
+			JobSystem::current_arena = arena;
+			handle.resume();
+			JobSystem::current_arena = outerArena;
+		}, priority);
+}
+
+//Everything of the promise of a task that does not depend on its result.
+struct TaskPromiseBase
+{
+	//Resumes the task awaiting this one, or reports the completion if the task was started on its own.
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			TaskPromiseBase& promise = handle.promise();
+			if (promise.continuation)
+			{
+				return promise.continuation;
+			}
+			//The task can be destroyed as soon as its completion is reported, nothing of it may be touched afterwards.
+			promise.onCompleted(promise);
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	//Resumes the task once all jobs attached to the counter are finished.
+	struct CounterAwaiter
+	{
+		bool await_ready()
+		{
+			if (counter.value.load(std::memory_order_acquire) != 0)
+			{
+				return false;
+			}
+			//Returns right away, it only makes sure whoever brought the counter to zero is done with it, as the task
+			//could destroy it next.
+			jobsystem.WaitForCounter(counter);
+			return true;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			jobsystem.AddJobAfterCounter(CreateResumeJob(jobsystem, handle, arena, GetTaskPriority()), counter, waiter);
+		}
+
+		void await_resume() {}
+
+		JobSystem& jobsystem;
+		JobCounter& counter;
+		FrameArena* arena;
+		CounterWaiter waiter;
+	};
+
+	//Resumes the task once the job is finished.
+	struct JobAwaiter
+	{
+		bool await_ready()
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			//If the job is already finished there is no dependency, so the task is resumed right away.
+			Job* resumeJob = CreateResumeJob(jobsystem, handle, arena, GetTaskPriority());
+			jobsystem.AddLateDependency(resumeJob, job);
+			jobsystem.AddJob(resumeJob);
+		}
+
+		void await_resume() {}
+
+		JobSystem& jobsystem;
+		Job* job;
+		FrameArena* arena;
+	};
+
+	TaskPromiseBase() : arena(JobSystem::current_arena) {}
+
+	static void* operator new(size_t size)
+	{
+		return AllocateTaskFrame(size);
+	}
+
+	static void operator delete(void* frame, size_t size)
+	{
+		FreeTaskFrame(frame, size);
+	}
+
+	std::suspend_always initial_suspend() noexcept
+	{
+		return {};
+	}
+
+	FinalAwaiter final_suspend() noexcept
+	{
+		return {};
+	}
+
+	void unhandled_exception() noexcept
+	{
+		std::terminate();
+	}
+
+	//Lets co_await take counters and jobs directly, everything else is awaited as it is.
+	CounterAwaiter await_transform(JobCounter& counter)
+	{
+		return CounterAwaiter{ *jobsystem, counter, arena, {} };
+	}
+
+	//The job has to stay valid memory until the task is resumed, which jobs allocated from a frame arena are.
+	JobAwaiter await_transform(Job* job)
+	{
+		return JobAwaiter{ *jobsystem, job, arena };
+	}
+
+	template<typename Awaitable>
+	Awaitable&& await_transform(Awaitable&& awaitable)
+	{
+		return std::forward<Awaitable>(awaitable);
+	}
+
+	//Job system the task runs on, handed down from the task awaiting it.
+	JobSystem* jobsystem = nullptr;
+	//Frame arena that was current when the task was created, made current again whenever the task is resumed.
+	FrameArena* arena;
+	//Task awaiting this one, resumed once it completed.
+	std::coroutine_handle<> continuation;
+	//Called instead of resuming a continuation, if the task was started on its own.
+	void (*onCompleted)(TaskPromiseBase& promise) = nullptr;
+	void* completionContext = nullptr;
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase
+{
+	Task<T> get_return_object();
+
+	template<typename Value>
+	void return_value(Value&& value)
+	{
+		result.emplace(std::forward<Value>(value));
+	}
+
+	T& GetResult()
+	{
+		return *result;
+	}
+
+	std::optional<T> result;
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase
+{
+	Task<void> get_return_object();
+
+	void return_void() {}
+
+	void GetResult() {}
+};
+
+//Shared by the tasks of a WhenAny. Released by every one of them once it completed and by the WhenAny once it resumed.
+struct WhenAnyState
+{
+	WhenAnyState(JobSystem& jobsystem, JobCounter& counter, unsigned int references) : jobsystem(jobsystem), counter(counter), references(references) {}
+
+	//Allocates the state from the current frame arena like the frames of the tasks, otherwise from the heap. The tasks
+	//have to be done before their frame ends, so the state does not outlive the arena either.
+	static WhenAnyState* Create(JobSystem& jobsystem, JobCounter& counter, unsigned int references)
+	{
+		FrameArena* arena = JobSystem::current_arena;
+		void* memory = arena ? arena->Allocate(sizeof(WhenAnyState), alignof(WhenAnyState)) : nullptr;
+		if (memory)
+		{
+			WhenAnyState* state = new (memory) WhenAnyState(jobsystem, counter, references);
+			state->heapAllocated = false;
+			return state;
+		}
+		return new WhenAnyState(jobsystem, counter, references);
+	}
+
+	static void OnCompleted(TaskPromiseBase& promise)
+	{
+		WhenAnyState* state = static_cast<WhenAnyState*>(promise.completionContext);
+		TaskPromiseBase* winner = nullptr;
+		if (state->winner.compare_exchange_strong(winner, &promise, std::memory_order_acq_rel))
+		{
+			state->jobsystem.ReleaseCounter(&state->first);
+		}
+		state->jobsystem.ReleaseCounter(&state->counter);
+		state->Release();
+	}
+
+	void Release()
+	{
+		if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			if (heapAllocated)
+			{
+				delete this;
+			}
+			else
+			{
+				this->~WhenAnyState();
+			}
+		}
+	}
+
+	JobSystem& jobsystem;
+	//Counter of the caller all of the tasks are attached to
+	JobCounter& counter;
+	//Released by the first task to complete
+	JobCounter first;
+	std::atomic<TaskPromiseBase*> winner = nullptr;
+	std::atomic<unsigned int> references;
+	//Only states allocated on the heap have to be deleted, arena memory is released with its frame.
+	bool heapAllocated = true;
+};
+
+template<typename T = void>
+class Task
+{
+public:
+	typedef TaskPromise<T> promise_type;
+
+	Task() {}
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+	Task& operator=(Task&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Destroy();
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	//A task that was started must have completed before it is destroyed.
+	~Task()
+	{
+		Destroy();
+	}
+
+	bool IsDone() const
+	{
+		return handle && handle.done();
+	}
+
+	//Result of the completed task. Awaiting a completed task returns it as well.
+	decltype(auto) GetResult()
+	{
+		return handle.promise().GetResult();
+	}
+
+	//Starts the task in a job of the given priority. The task is attached to the counter until it completed, so
+	//waiting for the counter waits for the task. It must not be awaited or destroyed before that.
+	void Start(JobSystem& jobsystem, JobCounter& counter, JobPriority priority = JobPriority::Normal)
+	{
+		jobsystem.AttachToCounter(counter);
+		Start(jobsystem, &ReleaseTaskCounter, &counter, priority);
+	}
+
+	//Awaiting a temporary task moves the result out of it, otherwise the result stays in the task.
+	auto operator co_await() &
+	{
+		struct ResultAwaiter : Awaiter
+		{
+			decltype(auto) await_resume()
+			{
+				return this->handle.promise().GetResult();
+			}
+		};
+		return ResultAwaiter{ { handle } };
+	}
+
+	auto operator co_await() &&
+	{
+		struct ResultAwaiter : Awaiter
+		{
+			T await_resume()
+			{
+				if constexpr (!std::is_void_v<T>)
+				{
+					return std::move(this->handle.promise().GetResult());
+				}
+			}
+		};
+		return ResultAwaiter{ { handle } };
+	}
+
+private:
+	struct Awaiter
+	{
+		bool await_ready()
+		{
+			return handle.done();
+		}
+
+		//Runs the task right away on the calling worker, it resumes the awaiting task once it completed.
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting)
+		{
+			handle.promise().jobsystem = awaiting.promise().jobsystem;
+			handle.promise().continuation = awaiting;
+			return handle;
+		}
+
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	template<typename U>
+	friend Task<size_t> WhenAny(JobSystem& jobsystem, std::vector<Task<U>>& tasks, JobCounter& counter);
+
+	static void ReleaseTaskCounter(TaskPromiseBase& promise)
+	{
+		promise.jobsystem->ReleaseCounter(static_cast<JobCounter*>(promise.completionContext));
+	}
+
+	//Starts the task in a job, onCompleted is called with the promise once the task completed.
+	void Start(JobSystem& jobsystem, void (*onCompleted)(TaskPromiseBase& promise), void* completionContext, JobPriority priority)
+	{
+		promise_type& promise = handle.promise();
+		promise.jobsystem = &jobsystem;
+		promise.onCompleted = onCompleted;
+		promise.completionContext = completionContext;
+		jobsystem.AddJob(CreateResumeJob(jobsystem, handle, promise.arena, priority));
+	}
+
+	void Destroy()
+	{
+		if (handle)
+		{
+			handle.destroy();
+			handle = nullptr;
+		}
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+//Awaiting it continues the task in a new job of the given priority.
+struct ScheduleAwaiter
+{
+	bool await_ready()
+	{
+		return false;
+	}
+
+	template<typename Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		jobsystem.AddJob(CreateResumeJob(jobsystem, handle, handle.promise().arena, priority));
+	}
+
+	void await_resume() {}
+
+	JobSystem& jobsystem;
+	JobPriority priority;
+};
+
+//Moves the rest of the task into a new job, so it can be stolen by another worker or continue with another priority.
+inline ScheduleAwaiter Schedule(JobSystem& jobsystem, JobPriority priority = JobPriority::Normal)
+{
+	return ScheduleAwaiter{ jobsystem, priority };
+}
+
+//Starts the task and waits for it to complete, working jobs in the meantime like WaitForCounter. Returns a reference to
+//the result, which stays in the task.
+template<typename T>
+decltype(auto) WaitForTask(JobSystem& jobsystem, Task<T>& task)
+{
+	JobCounter counter;
+	task.Start(jobsystem, counter, GetTaskPriority());
+	jobsystem.WaitForCounter(counter);
+	return task.GetResult();
+}
+
+//Runs all tasks at the same time and completes once all of them completed. Every task but the last one is started in a
+//job of its own, the last one runs right away on the calling worker. The results stay in the tasks.
+template<typename T>
+Task<void> WhenAll(JobSystem& jobsystem, std::vector<Task<T>>& tasks)
+{
+	if (tasks.empty())
+	{
+		co_return;
+	}
+	JobCounter counter;
+	for (size_t i = 0; i + 1 < tasks.size(); ++i)
+	{
+		tasks[i].Start(jobsystem, counter, GetTaskPriority());
+	}
+	co_await tasks.back();
+	co_await counter;
+}
+
+template<typename... Ts>
+Task<void> WhenAll(JobSystem& jobsystem, Task<Ts>&... tasks)
+{
+	JobCounter counter;
+	size_t index = 0;
+	((++index < sizeof...(Ts) ? tasks.Start(jobsystem, counter, GetTaskPriority()) : void()), ...);
+	auto& lastTask = std::get<sizeof...(Ts) - 1>(std::tie(tasks...));
+	co_await lastTask;
+	co_await counter;
+}
+
+//Runs all tasks at the same time and completes with the index of the first one to complete. The others keep running,
+//they are attached to the counter and must not be awaited or destroyed before it reached zero.
+template<typename T>
+Task<size_t> WhenAny(JobSystem& jobsystem, std::vector<Task<T>>& tasks, JobCounter& counter)
+{
+	if (tasks.empty())
+	{
+		co_return 0;
+	}
+	//The state outlives this task, as the remaining tasks report their completion to it as well.
+	WhenAnyState* state = WhenAnyState::Create(jobsystem, counter, static_cast<unsigned int>(tasks.size()) + 1);
+	jobsystem.AttachToCounter(state->first);
+	for (Task<T>& task : tasks)
+	{
+		jobsystem.AttachToCounter(counter);
+		task.Start(jobsystem, &WhenAnyState::OnCompleted, state, GetTaskPriority());
+	}
+	co_await state->first;
+	TaskPromiseBase* winner = state->winner.load(std::memory_order_acquire);
+	state->Release();
+	size_t index = 0;
+	while (&tasks[index].handle.promise() != winner)
+	{
+		index++;
+	}
+	co_return index;
+}
@@ -19,7 +19,7 @@
 
 ##Bonus points
 -[x] Implement the work-stealing algorithm to use the available resources more efficiently(+10 pts)
--[] Implement the work-stealing queue(requires the above bonus task) with lock - free mechanisms (+5 pts, but please
+-[x] Implement the work-stealing queue(requires the above bonus task) with lock - free mechanisms (+5 pts, but please
 	really only try this if you feel confident and if your solution is already working with locks, don not go for this for
 	the first iteration)
 -[x] Allow configuration of the max worker thread count via command-line parameters and validate them against available
@@ -30,11 +30,14 @@
 /*
 ##Summary:
 This is an implementation of a work stealing jobsystem. It is very specific implementation for demo purposes, because of this
-every job gets spawned through a "main" thread. Because of this the work gets split among the threads in a round robin scheme,
-instead of the usual way where jobs get put in the queue of the caller thread. The job system depends on conditional variables
+every job gets spawned through a "main" thread. Jobs added by a worker are put in the queue of the calling worker, so spawned
+work stays in the cache of the core that created it. Jobs added by the "main" thread (or any other thread outside of the system)
+go into a shared injection queue that every worker picks up from once its own queue is empty. The job system depends on conditional variables
 in each queue to wait for new work, when none is available, so it does not waste 100% of the CPU for nothing. 
-The queue itself uses lock guards to ensure thread safe accesse to the stored data, as it is possible for two threads to access
-at same time, when one (or more= of the thread is stealing. For more detail check the source files itself (Jobsystem.h, Jobsystem.cpp,
+The queue itself is a lock-free Chase-Lev work-stealing deque: the owning worker pushes and pops on the private end without
+any locks, while thieves take jobs from the public end using a compare and swap. As only the owner may push onto the deque,
+jobs from outside of the system always go through the injection queue. The previous implementation, which uses lock
+guards around a std::deque, can be selected by undefining LOCK_FREE_QUEUE in Settings.h. For more detail check the source files itself (Jobsystem.h, Jobsystem.cpp,
 JobQueue.h, JobQueue.cpp)
 
 In Settings.h are some flags defined that control the program.
@@ -45,9 +48,9 @@ amount of hardware threads). If not arguement is given, a default optimum amount
 
 #include <cstdio>
 #include <cstdint>
-#ifdef MEASURING_AVERAGE_TIME
+#if defined(MEASURING_AVERAGE_TIME) || defined(REPORT_CRITICAL_PATH) || defined(PIPELINED_FRAMES)
 #include <chrono>
-#endif //MEASURING_AVERAGE_TIME
+#endif //MEASURING_AVERAGE_TIME || REPORT_CRITICAL_PATH || PIPELINED_FRAMES
 #include <thread>
 #include <queue>
 #include <algorithm>
@@ -70,6 +73,7 @@ amount of hardware threads). If not arguement is given, a default optimum amount
 #include "optick_src/optick.h"
 #include "Settings.h"
 #include "JobSystem.h"
+#include "Benchmarks.h"
 
 
 using namespace std;
@@ -143,44 +147,138 @@ void UpdateSerial()
 * as you see fit for your implementation (to avoid global state)
 * ===============================================================
 */
+#ifdef REPLAY_JOB_GRAPH
+//Records the same jobs UpdateParallel creates every frame into a graph.
+bool CompileFrameGraph(JobGraph& graph)
+{
+	unsigned int updateInputNode = graph.AddNode(&UpdateInput, JobPriority::High, 200);
+	unsigned int updatePhysicsNode = graph.AddNode(&UpdatePhysics, JobPriority::High, 1000);
+	unsigned int updateCollisionNode = graph.AddNode(&UpdateCollision, JobPriority::High, 1200);
+	unsigned int updateAnimationNode = graph.AddNode(&UpdateAnimation, JobPriority::High, 600);
+	unsigned int updateGameElementsNode = graph.AddNode(&UpdateGameElements, JobPriority::High, 2400);
+	unsigned int updateRenderingNode = graph.AddNode(&UpdateRendering, JobPriority::High, 2000);
+	graph.AddNode(&UpdateSound, JobPriority::Low, 1000);
+
+	graph.AddDependency(updatePhysicsNode, updateInputNode);
+	graph.AddDependency(updateCollisionNode, updatePhysicsNode);
+	graph.AddDependency(updateAnimationNode, updateCollisionNode);
+	graph.AddDependency(updateGameElementsNode, updatePhysicsNode);
+
+	graph.AddDependency(updateRenderingNode, updateAnimationNode);
+	graph.AddDependency(updateRenderingNode, updateGameElementsNode);
+
+	for (int i = 0; i < PARTICLE_JOB_COUNT; ++i) {
+		unsigned int updateParticlesNode = graph.AddNode(&UpdateParticles, JobPriority::Normal, 800);
+		graph.AddDependency(updateParticlesNode, updateCollisionNode);
+		graph.AddDependency(updateRenderingNode, updateParticlesNode);
+	}
+	return graph.Compile();
+}
+#endif // REPLAY_JOB_GRAPH
+
+//Creates and adds all jobs of one frame, attaching them to the frame counter. If the rendering job of the previous frame
+//is given, rendering of this frame waits for it. Returns the rendering job of this frame if it was allocated from a
+//frame arena, as only those stay valid after they finished, otherwise nullptr.
+Job* CreateFrameJobs(JobSystem& jobsystem, JobCounter& frameCounter, Job* previousRenderingJob)
+{
+	//Everything on the way to Rendering is high priority, as the frame is not done before Rendering is. Sound does not
+	//block anything, so it is only worked when nothing else is left.
+	Job* updateInputJob = jobsystem.CreateJob(&UpdateInput, JobPriority::High);
+	Job* updatePhysicsJob = jobsystem.CreateJob(&UpdatePhysics, JobPriority::High);
+	Job* updateCollisionJob = jobsystem.CreateJob(&UpdateCollision, JobPriority::High);
+	Job* updateAnimationJob = jobsystem.CreateJob(&UpdateAnimation, JobPriority::High);
+	Job* updateGameElementsJob = jobsystem.CreateJob(&UpdateGameElements, JobPriority::High);
+	Job* updateRenderingJob = jobsystem.CreateJob(&UpdateRendering, JobPriority::High);
+	Job* updateSoundJob = jobsystem.CreateJob(&UpdateSound, JobPriority::Low);
+	//The estimated costs are the durations of the update functions, which are replaced by measurements once the
+	//jobs ran. They are only used with CRITICAL_PATH_SCHEDULING.
+	jobsystem.SetCost(updateInputJob, 200, reinterpret_cast<const void*>(&UpdateInput));
+	jobsystem.SetCost(updatePhysicsJob, 1000, reinterpret_cast<const void*>(&UpdatePhysics));
+	jobsystem.SetCost(updateCollisionJob, 1200, reinterpret_cast<const void*>(&UpdateCollision));
+	jobsystem.SetCost(updateAnimationJob, 600, reinterpret_cast<const void*>(&UpdateAnimation));
+	jobsystem.SetCost(updateGameElementsJob, 2400, reinterpret_cast<const void*>(&UpdateGameElements));
+	jobsystem.SetCost(updateRenderingJob, 2000, reinterpret_cast<const void*>(&UpdateRendering));
+	jobsystem.SetCost(updateSoundJob, 1000, reinterpret_cast<const void*>(&UpdateSound));
+
+	
+	jobsystem.AddDependency(updatePhysicsJob, updateInputJob);
+	jobsystem.AddDependency(updateCollisionJob, updatePhysicsJob);
+	jobsystem.AddDependency(updateAnimationJob, updateCollisionJob);
+	jobsystem.AddDependency(updateGameElementsJob, updatePhysicsJob);
+
+	jobsystem.AddDependency(updateRenderingJob, updateAnimationJob);
+	jobsystem.AddDependency(updateRenderingJob, updateGameElementsJob);
+	if (previousRenderingJob) {
+		//Frames have to be rendered in order, even though the rest of the frames can overlap.
+		jobsystem.AddLateDependency(updateRenderingJob, previousRenderingJob);
+	}
+
+#ifdef PARALLEL_FOR_PARTICLES
+	//A single job spreads the particle updates over the workers, the jobs are only split off as workers become idle.
+	Job* updateParticlesJob = jobsystem.CreateJob([&jobsystem]() {
+		jobsystem.ParallelFor(0, PARTICLE_JOB_COUNT, [](size_t) { UpdateParticles(); }, 1);
+	});
+	jobsystem.SetCost(updateParticlesJob, 800);
+	jobsystem.AddDependency(updateParticlesJob, updateCollisionJob);
+	jobsystem.AddDependency(updateRenderingJob, updateParticlesJob);
+	jobsystem.AddJob(updateParticlesJob, &frameCounter);
+#else
+	//create multiple particle jobs for stress testing
+	for (int i = 0; i < PARTICLE_JOB_COUNT; ++i) {
+		Job* updateParticlesJob = jobsystem.CreateJob(&UpdateParticles);
+		jobsystem.SetCost(updateParticlesJob, 800, reinterpret_cast<const void*>(&UpdateParticles));
+		jobsystem.AddDependency(updateParticlesJob, updateCollisionJob);
+		jobsystem.AddDependency(updateRenderingJob, updateParticlesJob);
+		jobsystem.AddJob(updateParticlesJob, &frameCounter);
+	}
+#endif // PARALLEL_FOR_PARTICLES
+	//The job can already be finished (and handed back to its pool) once it is added.
+	bool isRenderingJobValid = updateRenderingJob->pool == nullptr;
+	jobsystem.AddJob(updateRenderingJob, &frameCounter);
+	jobsystem.AddJob(updatePhysicsJob, &frameCounter);
+	jobsystem.AddJob(updateAnimationJob, &frameCounter);
+	jobsystem.AddJob(updateInputJob, &frameCounter);
+	jobsystem.AddJob(updateCollisionJob, &frameCounter);
+	jobsystem.AddJob(updateGameElementsJob, &frameCounter);
+	jobsystem.AddJob(updateSoundJob, &frameCounter);
+	return isRenderingJobValid ? updateRenderingJob : nullptr;
+}
+
 void UpdateParallel(JobSystem& jobsystem, std::atomic<bool>& isRunning)
 {
 	OPTICK_EVENT();
 	PRINT("Parallel\n");
 
+#ifdef REPLAY_JOB_GRAPH
+	//The graphs are only recorded once and then replayed every frame. Every frame in flight needs its own graph, as the
+	//jobs of a graph can not run twice at the same time.
+	static JobGraph frameGraphs[SIMULATENOUS_FRAME_COUNT];
+	static bool areFrameGraphsCompiled = []() {
+		bool compiled = true;
+		for (JobGraph& frameGraph : frameGraphs) {
+			compiled = CompileFrameGraph(frameGraph) && compiled;
+		}
+		if (!compiled) {
+			//Compile already printed why, replaying an uncompiled graph would not run any job.
+			PRINT_ESSENTIAL("Frame graphs could not be compiled, creating the frame jobs every frame instead.\n");
+		}
+		return compiled;
+	}();
+#endif // REPLAY_JOB_GRAPH
+	//Each frame allocates its jobs from its own arena, which is released as a whole once the frame is done.
+	FrameArena* frameArenas[SIMULATENOUS_FRAME_COUNT];
+	//Counts the unfinished jobs of all frames of this update.
+	JobCounter frameCounter;
 	//run multiple frames at same time for stress testing.
 	for (int i = 0; i < SIMULATENOUS_FRAME_COUNT; ++i) {
-		Job* updateInputJob = jobsystem.CreateJob(&UpdateInput);
-		Job* updatePhysicsJob = jobsystem.CreateJob(&UpdatePhysics);
-		Job* updateCollisionJob = jobsystem.CreateJob(&UpdateCollision);
-		Job* updateAnimationJob = jobsystem.CreateJob(&UpdateAnimation);
-		Job* updateGameElementsJob = jobsystem.CreateJob(&UpdateGameElements);
-		Job* updateRenderingJob = jobsystem.CreateJob(&UpdateRendering);
-		Job* updateSoundJob = jobsystem.CreateJob(&UpdateSound);
-
-		
-		jobsystem.AddDependency(updatePhysicsJob, updateInputJob);
-		jobsystem.AddDependency(updateCollisionJob, updatePhysicsJob);
-		jobsystem.AddDependency(updateAnimationJob, updateCollisionJob);
-		jobsystem.AddDependency(updateGameElementsJob, updatePhysicsJob);
-
-		jobsystem.AddDependency(updateRenderingJob, updateAnimationJob);
-		jobsystem.AddDependency(updateRenderingJob, updateGameElementsJob);
-
-		//create multiple particle jobs for stress testing
-		for (int i = 0; i < PARTICLE_JOB_COUNT; ++i) {
-			Job* updateParticlesJob = jobsystem.CreateJob(&UpdateParticles);
-			jobsystem.AddDependency(updateParticlesJob, updateCollisionJob);
-			jobsystem.AddDependency(updateRenderingJob, updateParticlesJob);
-			jobsystem.AddJob(updateParticlesJob);
+		frameArenas[i] = jobsystem.BeginFrame();
+#ifdef REPLAY_JOB_GRAPH
+		if (areFrameGraphsCompiled) {
+			jobsystem.Run(frameGraphs[i], &frameCounter);
+			continue;
 		}
-		jobsystem.AddJob(updateRenderingJob);
-		jobsystem.AddJob(updatePhysicsJob);
-		jobsystem.AddJob(updateAnimationJob);
-		jobsystem.AddJob(updateInputJob);
-		jobsystem.AddJob(updateCollisionJob);
-		jobsystem.AddJob(updateGameElementsJob);
-		jobsystem.AddJob(updateSoundJob);
+#endif // REPLAY_JOB_GRAPH
+		CreateFrameJobs(jobsystem, frameCounter, nullptr);
 	}
 	//Wait for all jobs of this frame to be finished. We weren't sure if this is what this exercise intended, but it
 	//made the most sense to us, because otherwise it would for example be possible that the render job of frame 1 would
@@ -188,9 +286,86 @@ void UpdateParallel(JobSystem& jobsystem, std::atomic<bool>& isRunning)
 	//application it would also make sense to allow jobs to be defined to be frame independet, and thus allowing them to 
 	//be worked over more than a few frames to ensure fps smoothness (which would be useful for something like asset streaming for
 	//example).
-	jobsystem.WaitForAllJobs();
+	//While waiting this thread works jobs of the frame itself, so it does not leave a core idle.
+	jobsystem.WaitForCounter(frameCounter);
+	for (FrameArena* frameArena : frameArenas) {
+		jobsystem.EndFrame(frameArena);
+	}
 }
 
+#ifdef PIPELINED_FRAMES
+//A frame that was submitted but not waited for yet.
+struct FrameInFlight
+{
+	JobCounter counter;
+	FrameArena* arena = nullptr;
+	chrono::steady_clock::time_point submitTime;
+};
+
+//Frames in flight are kept in a ring, oldest first.
+struct FramePipeline
+{
+	FrameInFlight frames[FRAMES_IN_FLIGHT];
+	int oldest = 0;
+	int count = 0;
+	//Rendering job of the newest frame. nullptr once that frame is retired, as its arena is released then.
+	Job* lastRenderingJob = nullptr;
+	//Measurements since the last report
+	int retiredFrameCount = 0;
+	long long latencySum = 0;
+	chrono::steady_clock::time_point reportStart = chrono::steady_clock::now();
+};
+
+//Waits for the oldest frame in flight and releases its arena.
+void RetireOldestFrame(JobSystem& jobsystem, FramePipeline& pipeline)
+{
+	FrameInFlight& frame = pipeline.frames[pipeline.oldest];
+	jobsystem.WaitForCounter(frame.counter);
+	jobsystem.EndFrame(frame.arena);
+	pipeline.oldest = (pipeline.oldest + 1) % FRAMES_IN_FLIGHT;
+	pipeline.count--;
+	if (pipeline.count == 0) {
+		pipeline.lastRenderingJob = nullptr;
+	}
+
+	auto now = chrono::steady_clock::now();
+	pipeline.latencySum += chrono::duration_cast<chrono::microseconds>(now - frame.submitTime).count();
+	if (++pipeline.retiredFrameCount == PIPELINE_REPORT_INTERVAL) {
+		long long reportTime = chrono::duration_cast<chrono::microseconds>(now - pipeline.reportStart).count();
+		PRINT_ESSENTIAL(("Pipelined frames: " + to_string(pipeline.retiredFrameCount * 1000000.0 / reportTime) + " frames/s, average latency " +
+			to_string(pipeline.latencySum / pipeline.retiredFrameCount) + "us with up to " + to_string(FRAMES_IN_FLIGHT) + " frames in flight.\n").c_str());
+		pipeline.retiredFrameCount = 0;
+		pipeline.latencySum = 0;
+		pipeline.reportStart = now;
+	}
+}
+
+//Submits one frame, only waiting for the oldest frame if FRAMES_IN_FLIGHT are in flight already. Early stages of the
+//new frame can then run while the previous frames are still rendering.
+void UpdatePipelined(JobSystem& jobsystem, FramePipeline& pipeline)
+{
+	OPTICK_EVENT();
+	PRINT("Pipelined\n");
+
+	if (pipeline.count == FRAMES_IN_FLIGHT) {
+		RetireOldestFrame(jobsystem, pipeline);
+	}
+	FrameInFlight& frame = pipeline.frames[(pipeline.oldest + pipeline.count) % FRAMES_IN_FLIGHT];
+	pipeline.count++;
+	frame.arena = jobsystem.BeginFrame();
+	frame.submitTime = chrono::steady_clock::now();
+	Job* renderingJob = CreateFrameJobs(jobsystem, frame.counter, pipeline.lastRenderingJob);
+	//The next frame can only depend on this rendering job if it stays valid. Otherwise all frames in flight are
+	//finished before the next one starts.
+	if (!renderingJob) {
+		while (pipeline.count > 0) {
+			RetireOldestFrame(jobsystem, pipeline);
+		}
+	}
+	pipeline.lastRenderingJob = renderingJob;
+}
+#endif // PIPELINED_FRAMES
+
 
 #ifdef MEASURING_AVERAGE_TIME
 //Measures the average time a frame took.
@@ -262,6 +437,30 @@ int main(int argc, char* argv[])
 	//We spawn a "main" thread so we can have the actual main thread blocking to receive a potential quit
 	thread main_runner([&isRunning, &inputThreadCount]()
 		{
+#ifdef WAKE_UP_STRESS_TEST
+			RunWakeUpStressTest(inputThreadCount);
+#endif // WAKE_UP_STRESS_TEST
+#ifdef NESTED_WAIT_STRESS_TEST
+			RunNestedWaitStressTest(inputThreadCount);
+#endif // NESTED_WAIT_STRESS_TEST
+#ifdef STEAL_BENCHMARK
+			RunStealBenchmark(inputThreadCount);
+#endif // STEAL_BENCHMARK
+#ifdef TOPOLOGY_BENCHMARK
+			RunTopologyBenchmark(inputThreadCount);
+#endif // TOPOLOGY_BENCHMARK
+#ifdef PARALLEL_FOR_BENCHMARK
+			RunParallelForBenchmark(inputThreadCount);
+#endif // PARALLEL_FOR_BENCHMARK
+#ifdef PARALLEL_ALGORITHMS_BENCHMARK
+			RunParallelAlgorithmsBenchmark(inputThreadCount);
+#endif // PARALLEL_ALGORITHMS_BENCHMARK
+#ifdef TASK_BENCHMARK
+			RunTaskBenchmark(inputThreadCount);
+#endif // TASK_BENCHMARK
+#ifdef JOB_HANDLE_BENCHMARK
+			RunJobHandleBenchmark(inputThreadCount);
+#endif // JOB_HANDLE_BENCHMARK
 #ifdef MEASURING_AVERAGE_TIME
 			int maxThreadCount = 24;
 			for (int i = 1; i <= maxThreadCount; ++i) {
@@ -271,23 +470,67 @@ int main(int argc, char* argv[])
 
 			JobSystem jobsystem(isRunning, inputThreadCount);
 			OPTICK_THREAD("Update");
+#ifdef REPORT_CRITICAL_PATH
+			long long frameTimeSum = 0;
+			unsigned long long criticalPathSum = 0;
+			unsigned long long totalCostSum = 0;
+			int reportedFrameCount = 0;
+#endif // REPORT_CRITICAL_PATH
+#ifdef PIPELINED_FRAMES
+			FramePipeline framePipeline;
+#endif // PIPELINED_FRAMES
 			while (isRunning)
 			{
 				OPTICK_FRAME("Frame");
+#ifdef REPORT_CRITICAL_PATH
+				auto frameStart = std::chrono::steady_clock::now();
+#endif // REPORT_CRITICAL_PATH
 				if (isRunningParallel)
 				{
+#ifdef PIPELINED_FRAMES
+					UpdatePipelined(jobsystem, framePipeline);
+#else
 					UpdateParallel(jobsystem, isRunning);
+#endif // PIPELINED_FRAMES
 				}
 				else
 				{
 					UpdateSerial();
 				}
+#ifdef REPORT_CRITICAL_PATH
+				//The frame can not be faster than its critical path. The total cost shows how much work there is to spread over the workers.
+				frameTimeSum += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - frameStart).count();
+				criticalPathSum += jobsystem.GetCriticalPathLength();
+				totalCostSum += jobsystem.GetTotalCost();
+				if (++reportedFrameCount == CRITICAL_PATH_REPORT_INTERVAL)
+				{
+					PRINT_ESSENTIAL(("Average frame time: " + std::to_string(frameTimeSum / reportedFrameCount) + "us, critical path: " +
+						std::to_string(criticalPathSum / reportedFrameCount) + "us, total cost: " + std::to_string(totalCostSum / reportedFrameCount) + "us.\n").c_str());
+					frameTimeSum = 0;
+					criticalPathSum = 0;
+					totalCostSum = 0;
+					reportedFrameCount = 0;
+				}
+#endif // REPORT_CRITICAL_PATH
 #ifdef RUN_ONCE
+#ifdef PIPELINED_FRAMES
+				while (framePipeline.count > 0)
+				{
+					RetireOldestFrame(jobsystem, framePipeline);
+				}
+#endif // PIPELINED_FRAMES
 				isRunning = false;
 #endif // RUN_ONCE
 			}
 			//Join all jobs to ensure clean quit
 			jobsystem.JoinJobs();
+#ifdef PIPELINED_FRAMES
+			//No job runs anymore, so the arenas of the frames still in flight can be released.
+			while (framePipeline.count > 0)
+			{
+				RetireOldestFrame(jobsystem, framePipeline);
+			}
+#endif // PIPELINED_FRAMES
 		});
 #ifndef RUN_ONCE
 	printf("Type anything to quit...\n");